@@ -0,0 +1,45 @@
+#!/bin/bash
+# Time the specialised check loops against the generic criteria table, for each combination of criteria that
+# has a specialised loop. The inputs are repeated to make a run long enough to time. The generic times come from
+# fastq_filterer_generic, which make bench_filter builds to always use the criteria table.
+#
+# Usage: filter_bench.sh <r1.fastq> <r2.fastq> [copies] [rm_reads.txt]
+
+r1=$1
+r2=$2
+copies=${3:-20000}
+rm_reads=${4:-test/inputs/rm_reads.txt}
+tmp_dir=$(mktemp -d)
+trap 'rm -rf $tmp_dir' EXIT
+
+for i in $(seq $copies); do echo $r1; done | xargs cat > $tmp_dir/R1.fastq
+for i in $(seq $copies); do echo $r2; done | xargs cat > $tmp_dir/R2.fastq
+tile=$(head -n 1 $r1 | cut -d ' ' -f 1 | cut -d ':' -f 5)
+
+function run_filterer {
+    filterer=$1
+    shift
+    $filterer --quiet --i1 $tmp_dir/R1.fastq --i2 $tmp_dir/R2.fastq --threshold 10 \
+        --o1 /dev/null --o2 /dev/null --f1 /dev/null --f2 /dev/null $* > /dev/null
+}
+
+function time_filterer {
+    start=$(date +%s%N)
+    for i in 1 2 3; do
+        run_filterer $*
+    done
+    echo $(( ($(date +%s%N) - start) / 3000000 ))
+}
+
+printf "%-32s %12s %16s\n" "criteria" "generic ms" "specialised ms"
+for criteria in "" "remove_tiles" "remove_reads" "remove_tiles remove_reads"; do
+    args=""
+    for c in $criteria; do
+        [ $c == remove_tiles ] && args="$args --remove_tiles $tile"
+        [ $c == remove_reads ] && args="$args --remove_reads $rm_reads"
+    done
+    run_filterer ./fastq_filterer $args  # warm up the page cache
+    generic=$(time_filterer ./fastq_filterer_generic $args)
+    specialised=$(time_filterer ./fastq_filterer $args)
+    printf "%-32s %12s %16s\n" "threshold $criteria" $generic $specialised
+done
@@ -0,0 +1,104 @@
+/*
+ Benchmark each compiled-in InflateBackend on the same BGZF file, along with zlib's streaming gzread that is
+ used for non-BGZF input, and report the decompression speed of each in MB/s of uncompressed output.
+
+ Usage: inflate_bench <file.fastq.gz> [repeats]
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+#include "../src/inflate.h"
+
+#define max_block_size 0x10000
+
+
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+static unsigned long get_le32(unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: inflate_bench <file.fastq.gz> [repeats]\n");
+        return 1;
+    }
+    int repeats = argc > 2 ? atoi(argv[2]) : 5;
+
+    FILE* f = fopen(argv[1], "rb");
+    if (f == NULL) {
+        printf("Could not open %s\n", argv[1]);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t file_size = ftell(f);
+    rewind(f);
+    unsigned char* data = malloc(file_size);
+    if (fread(data, 1, file_size, f) != file_size) {
+        printf("Could not read %s\n", argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    // find the start of each block from its BSIZE, assuming a standard 6-byte BGZF extra field
+    size_t nblocks = 0, pos = 0;
+    size_t* offsets = malloc(sizeof (size_t) * (file_size / 26 + 1));
+    while (pos + 18 <= file_size && data[pos] == 0x1f && data[pos + 12] == 'B' && data[pos + 13] == 'C') {
+        offsets[nblocks++] = pos;
+        pos += (data[pos + 16] | (data[pos + 17] << 8)) + 1;
+    }
+    if (nblocks == 0 || pos != file_size) {
+        printf("%s is not a BGZF file\n", argv[1]);
+        return 1;
+    }
+
+    char* out = malloc(max_block_size);
+    size_t out_len;
+    int i, r;
+    size_t b;
+    printf("%-24s %10s\n", "backend", "MB/s");
+
+    for (i=0; inflate_backends[i] != NULL; i++) {
+        InflateBackend* backend = inflate_backends[i];
+        void* state = backend->new_state();
+        size_t total = 0;
+        double start = now();
+        for (r=0; r<repeats; r++) {
+            for (b=0; b<nblocks; b++) {
+                unsigned char* block = data + offsets[b];
+                size_t block_len = (block[16] | (block[17] << 8)) + 1;
+                if (!backend->inflate(state, block + 18, block_len - 26, out, max_block_size, &out_len)
+                        || backend->crc32(0, out, out_len) != get_le32(block + block_len - 8)) {
+                    printf("%s failed on block %zu\n", backend->name, b);
+                    return 1;
+                }
+                total += out_len;
+            }
+        }
+        printf("%-24s %10.1f\n", backend->name, total / (now() - start) / 1e6);
+        backend->free_state(state);
+    }
+
+    char* buf = malloc(128 * 1024);
+    size_t total = 0;
+    double start = now();
+    for (r=0; r<repeats; r++) {
+        gzFile gz = gzopen(argv[1], "r");
+        gzbuffer(gz, 128 * 1024);
+        int nbytes;
+        while ((nbytes = gzread(gz, buf, 128 * 1024)) > 0) {
+            total += nbytes;
+        }
+        gzclose(gz);
+    }
+    printf("%-24s %10.1f\n", "zlib gzread (streaming)", total / (now() - start) / 1e6);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Run inflate_bench on a BGZF file. Without one, a BGZF input of a realistic size is made by repeating a small
+# fastq and compressing it with fastq_filterer's own BGZF output, so that each backend inflates full-size blocks.
+#
+# Usage: inflate_bench.sh [file.fastq.gz] [copies]
+
+input=$1
+copies=${2:-100000}
+if [ -z "$input" ]; then
+    tmp_dir=$(mktemp -d)
+    trap 'rm -rf $tmp_dir' EXIT
+    for i in $(seq $copies); do echo test/inputs/R1.fastq; done | xargs cat > $tmp_dir/R1.fastq
+    ./fastq_filterer --quiet --single_end --i1 $tmp_dir/R1.fastq --threshold 0 --compress_output=1 \
+        --o1 $tmp_dir/R1.fastq.gz --f1 /dev/null
+    input=$tmp_dir/R1.fastq.gz
+fi
+echo "Inflating $input ($(stat -c %s $input) bytes)"
+./inflate_bench $input
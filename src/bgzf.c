@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include "bgzf.h"
+
+#define bgzf_max_block_size 0x10000
+#define gzip_header_size 12  // up to and including XLEN
+#define gzip_footer_size 8
+
+
+static unsigned int get_le16(unsigned char* p) {
+    return p[0] | (p[1] << 8);
+}
+
+
+static unsigned long get_le32(unsigned char* p) {
+    return get_le16(p) | ((unsigned long) get_le16(p + 2) << 16);
+}
+
+
+static bool is_gzip_header(unsigned char* header) {
+    return header[0] == 0x1f && header[1] == 0x8b && header[2] == 8 && (header[3] & 4);  // deflate, with FEXTRA
+}
+
+
+static int find_bsize(unsigned char* extra, unsigned int xlen) {
+    /*
+     Find the 'BC' subfield in a gzip header's extra field, and return the total block size minus 1 that it
+     contains, or -1 if there isn't one.
+     */
+    unsigned int pos = 0;
+    while (pos + 4 <= xlen) {
+        unsigned int slen = get_le16(extra + pos + 2);
+        if (extra[pos] == 'B' && extra[pos + 1] == 'C' && slen == 2 && pos + 6 <= xlen) {
+            return get_le16(extra + pos + 4);
+        }
+        pos += 4 + slen;
+    }
+    return -1;
+}
+
+
+bool is_bgzf(FILE* f) {
+    /*
+     Check whether a file starts with a BGZF block header, then rewind it, so the file must be seekable.
+     */
+    unsigned char header[gzip_header_size + 6];
+    bool ret_val = false;
+    if (fread(header, 1, sizeof header, f) == sizeof header && is_gzip_header(header)) {
+        ret_val = get_le16(header + 10) == 6 && find_bsize(header + gzip_header_size, 6) >= 0;
+    }
+    rewind(f);
+    return ret_val;
+}
+
+
+static void inflate_block(Task* task) {
+    InflateJob* job = (InflateJob*) task;
+    unsigned int xlen = get_le16(job->in + 10);
+    unsigned char* footer = job->in + job->in_len - gzip_footer_size;
+    unsigned long crc = get_le32(footer);
+    unsigned long isize = get_le32(footer + 4);
+
+    job->ok = false;
+    job->out_len = 0;
+    job->out_pos = 0;
+    if (isize > bgzf_max_block_size) {
+        return;
+    }
+
+    size_t out_len;
+    bool inflated = job->backend->inflate(
+        job->state, job->in + gzip_header_size + xlen, job->in_len - gzip_header_size - xlen - gzip_footer_size,
+        job->out, bgzf_max_block_size, &out_len
+    );
+    if (inflated && out_len == isize) {
+        job->out_len = isize;
+        job->ok = job->backend->crc32(0, job->out, isize) == crc;
+    }
+}
+
+
+static bool read_block(BgzfReader* reader, InflateJob* job) {
+    /*
+     Read the next compressed block from the file into a job, without inflating it.
+     */
+    unsigned char* in = job->in;
+    size_t nbytes = fread(in, 1, gzip_header_size, reader->f);
+    if (nbytes == 0 && feof(reader->f)) {
+        reader->eof = true;
+        return false;
+    }
+    if (nbytes < gzip_header_size || !is_gzip_header(in)) {
+        reader->error = true;
+        return false;
+    }
+
+    unsigned int xlen = get_le16(in + 10);
+    int bsize = -1;
+    if (gzip_header_size + xlen + gzip_footer_size <= bgzf_max_block_size
+            && fread(in + gzip_header_size, 1, xlen, reader->f) == xlen) {
+        bsize = find_bsize(in + gzip_header_size, xlen) + 1;
+    }
+    if (bsize < (int) (gzip_header_size + xlen + gzip_footer_size)) {
+        reader->error = true;
+        return false;
+    }
+
+    size_t remaining = bsize - gzip_header_size - xlen;
+    if (fread(in + gzip_header_size + xlen, 1, remaining, reader->f) != remaining) {
+        reader->error = true;
+        return false;
+    }
+    job->in_len = bsize;
+    return true;
+}
+
+
+BgzfReader* bgzf_open(FILE* f, ThreadPool* pool, InflateBackend* backend) {
+    BgzfReader* reader = malloc(sizeof (BgzfReader));
+    reader->f = f;
+    reader->pool = pool;
+    reader->backend = backend;
+    reader->njobs = pool == NULL ? 1 : pool->nthreads * 2 + 1;
+    reader->jobs = malloc(sizeof (InflateJob) * reader->njobs);
+    reader->first = 0;
+    reader->pending = 0;
+    reader->eof = false;
+    reader->error = false;
+
+    int i;
+    for (i=0; i<reader->njobs; i++) {
+        InflateJob* job = &reader->jobs[i];
+        task_init(&job->task, inflate_block);
+        job->backend = backend;
+        job->state = backend->new_state();
+        job->in = malloc(bgzf_max_block_size);
+        job->out = malloc(bgzf_max_block_size);
+        job->in_len = 0;
+        job->out_len = 0;
+        job->out_pos = 0;
+    }
+    return reader;
+}
+
+
+int bgzf_read(BgzfReader* reader, char* buf, size_t len) {
+    /*
+     Copy up to len bytes of decompressed data into buf, keeping the pool topped up with blocks to inflate.
+
+     :output: the number of bytes copied, 0 at the end of the file, or -1 on a malformed or corrupt block
+     */
+    while (true) {
+        while (!reader->eof && !reader->error && reader->pending < reader->njobs) {
+            InflateJob* job = &reader->jobs[(reader->first + reader->pending) % reader->njobs];
+            if (!read_block(reader, job)) {
+                break;
+            }
+            reader->pending++;
+            if (reader->pool == NULL) {
+                inflate_block(&job->task);
+                job->task.done = true;
+            } else {
+                pool_submit(reader->pool, &job->task);
+            }
+        }
+
+        if (reader->pending == 0) {
+            return reader->error ? -1 : 0;
+        }
+
+        InflateJob* job = &reader->jobs[reader->first];
+        task_wait(&job->task);
+        if (!job->ok) {
+            reader->error = true;
+            return -1;
+        }
+        if (job->out_pos < job->out_len) {
+            size_t nbytes = job->out_len - job->out_pos;
+            if (nbytes > len) {
+                nbytes = len;
+            }
+            memcpy(buf, job->out + job->out_pos, nbytes);
+            job->out_pos += nbytes;
+            return nbytes;
+        }
+        reader->first = (reader->first + 1) % reader->njobs;
+        reader->pending--;
+    }
+}
+
+
+void bgzf_close(BgzfReader* reader) {
+    InflateBackend* backend = reader->backend;
+    int i;
+    for (i=0; i<reader->pending; i++) {  // let any blocks still in the pool finish before freeing them
+        task_wait(&reader->jobs[(reader->first + i) % reader->njobs].task);
+    }
+    for (i=0; i<reader->njobs; i++) {
+        backend->free_state(reader->jobs[i].state);
+        task_destroy(&reader->jobs[i].task);
+        free(reader->jobs[i].in);
+        free(reader->jobs[i].out);
+    }
+    free(reader->jobs);
+    fclose(reader->f);
+    free(reader);
+}
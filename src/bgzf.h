@@ -0,0 +1,43 @@
+#ifndef FastqFilterer_bgzf_h
+#define FastqFilterer_bgzf_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "inflate.h"
+#include "pool.h"
+
+
+typedef struct {
+    Task task;  // must be first, so the task can be cast back to its job
+    InflateBackend* backend;
+    void* state;
+    unsigned char* in;
+    size_t in_len;
+    char* out;
+    size_t out_len, out_pos;
+    bool ok;
+} InflateJob;
+
+
+/*
+ A reader for BGZF files, i.e. a series of gzip members of at most 64KB each, whose size is given in a 'BC'
+ extra field in each member's header. Since each block can be found without decompressing the ones before
+ it, blocks are read ahead and inflated in parallel on a ThreadPool, then handed back in order. Without a
+ ThreadPool, blocks are inflated one at a time as they are needed.
+ */
+typedef struct {
+    FILE* f;
+    ThreadPool* pool;
+    InflateBackend* backend;
+    InflateJob* jobs;  // ring of blocks being inflated, in file order
+    int njobs, first, pending;
+    bool eof, error;
+} BgzfReader;
+
+
+bool is_bgzf(FILE* f);
+BgzfReader* bgzf_open(FILE* f, ThreadPool* pool, InflateBackend* backend);
+int bgzf_read(BgzfReader* reader, char* buf, size_t len);
+void bgzf_close(BgzfReader* reader);
+
+#endif
@@ -0,0 +1,562 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fastq.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define x86_simd
+#endif
+
+#define read_chunk_size (128 * 1024)  // bytes read from the input file at a time
+#define initial_data_size (2 * 1024 * 1024)
+#define max_data_size ((size_t) INT32_MAX)  // a batch's reads are cut out at uint32 offsets with int lengths
+#define max_header_len 0xffff  // header fields are found at uint16 offsets
+
+
+/*
+ Newline scanners. Each finds every '\n' in data[start:end] and writes its offset from data to out,
+ returning the number found. On x86, the SSE2 version is always available and the AVX2 and AVX-512 versions
+ are chosen at runtime if the CPU supports them.
+ */
+static size_t scan_newlines_generic(char* data, size_t start, size_t end, uint32_t* out) {
+    size_t nfound = 0;
+    char* p = data + start;
+    char* newline;
+    while ((newline = memchr(p, '\n', data + end - p)) != NULL) {
+        out[nfound++] = newline - data;
+        p = newline + 1;
+    }
+    return nfound;
+}
+
+
+#ifdef x86_simd
+#define _scan_mask(mask, offset) \
+    while (mask) { \
+        out[nfound++] = (offset) + __builtin_ctzll(mask); \
+        mask &= mask - 1; \
+    }
+
+
+static size_t scan_newlines_sse2(char* data, size_t start, size_t end, uint32_t* out) {
+    size_t nfound = 0, i = start;
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= end; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i*) (data + i));
+        unsigned long long mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        _scan_mask(mask, i);
+    }
+    return nfound + scan_newlines_generic(data, i, end, out + nfound);
+}
+
+
+__attribute__((target("avx2")))
+static size_t scan_newlines_avx2(char* data, size_t start, size_t end, uint32_t* out) {
+    size_t nfound = 0, i = start;
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= end; i += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i*) (data + i));
+        unsigned long long mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        _scan_mask(mask, i);
+    }
+    return nfound + scan_newlines_sse2(data, i, end, out + nfound);
+}
+
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t scan_newlines_avx512(char* data, size_t start, size_t end, uint32_t* out) {
+    size_t nfound = 0, i = start;
+    const __m512i newline = _mm512_set1_epi8('\n');
+    for (; i + 64 <= end; i += 64) {
+        __m512i block = _mm512_loadu_si512((void*) (data + i));
+        unsigned long long mask = _mm512_cmpeq_epi8_mask(block, newline);
+        _scan_mask(mask, i);
+    }
+    return nfound + scan_newlines_sse2(data, i, end, out + nfound);
+}
+#endif
+
+
+static size_t (*scan_newlines)(char*, size_t, size_t, uint32_t*) = NULL;
+static char* scanner_name = NULL;
+static pthread_once_t scanner_chosen = PTHREAD_ONCE_INIT;  // readers may be opened on several threads at once
+
+
+static void choose_scanner() {
+    scan_newlines = scan_newlines_generic;
+    scanner_name = "generic";
+#ifdef x86_simd
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan_newlines = scan_newlines_avx512;
+        scanner_name = "avx512";
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_newlines = scan_newlines_avx2;
+        scanner_name = "avx2";
+    } else {
+        scan_newlines = scan_newlines_sse2;
+        scanner_name = "sse2";
+    }
+#endif
+}
+
+
+char* fastq_scanner_name() {
+    pthread_once(&scanner_chosen, choose_scanner);
+    return scanner_name;
+}
+
+
+/*
+ Batches are never freed while filtering, but put on a free list for reuse, so that once as many batches as
+ the run needs at once have been made, reading and filtering need no further allocation. Batches that own a
+ data buffer are kept on a separate list from those that only point into another batch, so that buffers are
+ only held by batches that read into them.
+ */
+static ReadBatch *free_buffered = NULL, *free_unbuffered = NULL;  // linked through source
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t memory_used = 0, peak_memory_used = 0;
+
+
+static void add_memory_used(long long nbytes) {
+    // called with free_lock held
+    memory_used += nbytes;
+    if (memory_used > peak_memory_used) {
+        peak_memory_used = memory_used;
+    }
+}
+
+
+static ReadBatch* pop_batch(ReadBatch** list) {
+    ReadBatch* batch = *list;
+    if (batch != NULL) {
+        *list = batch->source;
+    }
+    return batch;
+}
+
+
+static ReadBatch* get_batch(bool buffered) {
+    pthread_mutex_lock(&free_lock);
+    ReadBatch* batch = pop_batch(buffered ? &free_buffered : &free_unbuffered);
+    if (batch == NULL && buffered) {
+        batch = pop_batch(&free_unbuffered);
+    }
+    if (batch == NULL) {
+        batch = malloc(sizeof (ReadBatch));
+        batch->reads = malloc(sizeof (FastqRead) * batch_size);
+        batch->fields = NULL;
+        batch->data = NULL;
+        batch->data_size = 0;
+        add_memory_used(sizeof (ReadBatch) + sizeof (FastqRead) * batch_size);
+    }
+    pthread_mutex_unlock(&free_lock);
+
+    batch->nreads = 0;
+    batch->data_len = 0;
+    batch->source = NULL;
+    batch->refs = 1;
+    return batch;
+}
+
+
+ReadBatch* new_batch() {
+    // a batch to read into, reusing a freed batch's buffer if there is one
+    return get_batch(true);
+}
+
+
+ReadBatch* new_batch_of(ReadBatch* source) {
+    // a batch of reads from source, which is released once this batch is freed
+    ReadBatch* batch = get_batch(false);
+    batch->source = source;
+    return batch;
+}
+
+
+void free_batch(ReadBatch* batch) {
+    // put a batch on the free list, which now owns it
+    pthread_mutex_lock(&free_lock);
+    ReadBatch** list = batch->data == NULL ? &free_unbuffered : &free_buffered;
+    batch->source = *list;
+    *list = batch;
+    pthread_mutex_unlock(&free_lock);
+}
+
+
+void release_batch(ReadBatch* batch) {
+    /*
+     Drop a reference to a batch, which may be shared between threads, and free it if nothing else needs it,
+     releasing its own source in turn.
+     */
+    if (__atomic_sub_fetch(&batch->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        ReadBatch* source = batch->source;
+        free_batch(batch);
+        if (source != NULL) {
+            release_batch(source);
+        }
+    }
+}
+
+
+void split_interleaved(ReadBatch* batch, ReadBatch* r1_batch, ReadBatch* r2_batch) {
+    /*
+     Fill r1_batch and r2_batch with alternate reads of a batch read from an interleaved fastq, starting with R1.
+     Both point into the batch's buffer rather than copying it.
+     */
+    int i;
+    ReadBatch* halves[2] = {r1_batch, r2_batch};
+    for (i=0; i<2; i++) {
+        if (batch->fields != NULL && halves[i]->fields == NULL) {
+            halves[i]->fields = malloc(sizeof (HeaderFields) * batch_size);
+            pthread_mutex_lock(&free_lock);
+            add_memory_used(sizeof (HeaderFields) * batch_size);
+            pthread_mutex_unlock(&free_lock);
+        }
+    }
+    r1_batch->nreads = (batch->nreads + 1) / 2;
+    r2_batch->nreads = batch->nreads / 2;
+    for (i=0; i<batch->nreads; i++) {
+        ReadBatch* half = halves[i % 2];
+        half->reads[i / 2] = batch->reads[i];
+        if (batch->fields != NULL) {
+            half->fields[i / 2] = batch->fields[i];
+        }
+    }
+}
+
+
+void free_batches() {
+    // actually free every batch on the free list
+    ReadBatch* batch;
+    pthread_mutex_lock(&free_lock);
+    while ((batch = pop_batch(&free_buffered)) != NULL || (batch = pop_batch(&free_unbuffered)) != NULL) {
+        memory_used -= sizeof (ReadBatch) + sizeof (FastqRead) * batch_size + batch->data_size;
+        memory_used -= batch->fields == NULL ? 0 : sizeof (HeaderFields) * batch_size;
+        free(batch->data);
+        free(batch->reads);
+        free(batch->fields);
+        free(batch);
+    }
+    pthread_mutex_unlock(&free_lock);
+}
+
+
+size_t batch_memory_peak() {
+    return peak_memory_used;
+}
+
+
+static void resize_data(ReadBatch* batch, size_t data_size) {
+    pthread_mutex_lock(&free_lock);
+    add_memory_used((long long) data_size - (long long) batch->data_size);
+    pthread_mutex_unlock(&free_lock);
+    batch->data_size = data_size;
+    batch->data = realloc(batch->data, data_size);
+}
+
+
+static char* map_file(FILE* f, size_t* map_len) {
+    /*
+     Memory-map an uncompressed regular file for reading from start to end, then rewind it.
+
+     :output: the mapping, or NULL if the file is compressed, empty, or not a regular file
+     */
+    struct stat st;
+    unsigned char magic[2];
+    bool compressed = fread(magic, 1, 2, f) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    rewind(f);
+    if (compressed || fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+    *map_len = st.st_size;
+    return map;
+}
+
+
+FastqReader* fastq_open(char* path, ThreadPool* pool, bool parse_headers) {
+    /*
+     Open a fastq, fastq.gz or BGZF file, or stdin if the path is "-". Uncompressed regular files are
+     memory-mapped, and BGZF blocks are inflated with the default InflateBackend, in parallel if a ThreadPool is
+     given. Anything else, including any pipe, FIFO or other stream that can't be rewound after looking at its
+     first few bytes, is read through zlib. If parse_headers is set, each read's header fields are found as it is
+     read.
+     */
+    gzFile f = NULL;
+    BgzfReader* bgzf = NULL;
+    char* map = NULL;
+    size_t map_len = 0;
+    struct stat st;
+    FILE* raw = strcmp(path, "-") == 0 ? fdopen(dup(STDIN_FILENO), "rb") : fopen(path, "rb");
+    if (raw == NULL) {
+        return NULL;
+    }
+    bool regular = fstat(fileno(raw), &st) == 0 && S_ISREG(st.st_mode);
+
+    if (regular && is_bgzf(raw)) {
+        bgzf = bgzf_open(raw, pool, inflate_backend_default());
+    } else if (regular && (map = map_file(raw, &map_len)) != NULL) {
+        fclose(raw);
+    } else {
+        if (regular) {
+            lseek(fileno(raw), 0, SEEK_SET);  // rewinding raw may only have moved within its buffer
+        }
+        f = gzdopen(dup(fileno(raw)), "r");
+        fclose(raw);
+        if (f == NULL) {
+            return NULL;
+        }
+        gzbuffer(f, read_chunk_size);
+    }
+    pthread_once(&scanner_chosen, choose_scanner);
+
+    FastqReader* reader = malloc(sizeof (FastqReader));
+    reader->f = f;
+    reader->bgzf = bgzf;
+    reader->map = map;
+    reader->map_len = map_len;
+    reader->map_pos = 0;
+    reader->carry_size = read_chunk_size;
+    reader->carry = malloc(reader->carry_size);
+    reader->carry_len = 0;
+    reader->newlines_size = read_chunk_size;
+    reader->newlines = malloc(sizeof (uint32_t) * reader->newlines_size);
+    reader->nnewlines = 0;
+    reader->parse_headers = parse_headers;
+    reader->eof = false;
+    reader->error = false;
+    reader->error_reason = NULL;
+    return reader;
+}
+
+
+void fastq_close(FastqReader* reader) {
+    if (reader == NULL) {
+        return;
+    }
+    if (reader->bgzf != NULL) {
+        bgzf_close(reader->bgzf);
+    } else if (reader->map != NULL) {
+        munmap(reader->map, reader->map_len);
+    } else {
+        gzclose(reader->f);
+    }
+    free(reader->carry);
+    free(reader->newlines);
+    free(reader);
+}
+
+
+static char* split_field(char* p, char* end, char delimiter, char* header, HeaderField* field) {
+    // record the field from p up to the delimiter or end, and return where the next one starts
+    char* start = p;
+    while (p < end && *p != delimiter) {
+        p++;
+    }
+    field->start = start - header;
+    field->len = p - start;
+    return p < end ? p + 1 : end;
+}
+
+
+static bool parse_header(char* header, int header_len, HeaderFields* fields) {
+    /*
+     Find the fields of a header in one pass, without copying it.
+
+     :output: false if the header is too long for its fields' offsets to be recorded
+     */
+    memset(fields, 0, sizeof (HeaderFields));
+    char* end = header + header_len;
+    if (end > header && end[-1] == '\n') {
+        end--;
+    }
+    if (end - header > max_header_len) {
+        return false;
+    }
+    char* name = header < end ? header + 1 : end;  // skip the '@'
+    char* name_end = memchr(name, ' ', end - name);
+    if (name_end == NULL) {
+        name_end = end;
+    }
+    fields->name.start = name - header;
+    fields->name.len = name_end - name;
+
+    HeaderField unused;
+    HeaderField* name_fields[7] = {&unused, &unused, &unused, &fields->lane, &fields->tile, &fields->x, &fields->y};
+    char* p = name;
+    int i;
+    for (i=0; i<7 && p < name_end; i++) {
+        p = split_field(p, name_end, ':', header, name_fields[i]);
+    }
+
+    if (name_end == end) {
+        return true;
+    }
+    char* comment = name_end + 1;
+    char* comment_end = memchr(comment, ' ', end - comment);  // anything after the index is ignored
+    if (comment_end == NULL) {
+        comment_end = end;
+    }
+    HeaderField* comment_fields[4] = {&fields->read_number, &fields->filter_flag, &unused, &fields->index};
+    p = comment;
+    for (i=0; i<4 && p < comment_end; i++) {
+        p = split_field(p, comment_end, ':', header, comment_fields[i]);
+    }
+    return true;
+}
+
+
+static int read_chunk(FastqReader* reader, char* buf) {
+    if (reader->bgzf != NULL) {
+        return bgzf_read(reader->bgzf, buf, read_chunk_size);
+    }
+    return gzread(reader->f, buf, read_chunk_size);
+}
+
+
+int fastq_read_batch(FastqReader* reader, ReadBatch* batch) {
+    /*
+     Read the next batch_size reads (or however many are left) from a fastq into a batch. The batch's buffer
+     is reused, and grows if it needs to hold longer reads. For a memory-mapped file, nothing is copied, and
+     the reads point straight into the mapping instead. Each chunk read in is scanned for newlines once, and
+     reads are then cut out of it four newlines at a time.
+
+     :output: the number of reads in the batch, which is less than batch_size only at the end of the file
+     */
+    char* data;
+    size_t data_len = reader->carry_len;
+    batch->nreads = 0;
+    if (reader->map != NULL) {
+        data = reader->map + reader->map_pos;  // carry_len bytes from here on have already been scanned
+    } else {
+        if (batch->data_size < reader->carry_len + read_chunk_size) {
+            resize_data(batch, reader->carry_len + initial_data_size);
+        }
+        memcpy(batch->data, reader->carry, reader->carry_len);
+        data = batch->data;
+    }
+
+    size_t pos = 0, nl = 0;  // start of the next read, and the index of its first newline
+    int i;
+    while (batch->nreads < batch_size) {
+        FastqRead* read = &batch->reads[batch->nreads];
+        if (reader->nnewlines - nl >= 4) {
+            uint32_t* newline = reader->newlines + nl;
+            read->header_len = newline[0] + 1 - pos;
+            read->seq_len = newline[1] - newline[0];
+            read->strand_len = newline[2] - newline[1];
+            read->qual_len = newline[3] - newline[2];
+            pos = newline[3] + 1;
+            nl += 4;
+            batch->nreads++;
+
+        } else if (reader->eof) {
+            if (pos == data_len) {
+                break;
+            }
+            // the last line of the file may not have a trailing '\n', and any missing lines are taken as empty
+            int line_lens[4];
+            for (i=0; i<4; i++) {
+                if (nl < reader->nnewlines) {
+                    line_lens[i] = reader->newlines[nl++] + 1 - pos;
+                } else {
+                    line_lens[i] = data_len - pos;
+                }
+                pos += line_lens[i];
+            }
+            read->header_len = line_lens[0];
+            read->seq_len = line_lens[1];
+            read->strand_len = line_lens[2];
+            read->qual_len = line_lens[3];
+            batch->nreads++;
+
+        } else {
+            if (data_len + read_chunk_size > max_data_size) {
+                reader->eof = true;
+                reader->error = true;
+                reader->error_reason = "a batch of reads is over 2GB";
+                break;
+            }
+            int nbytes;
+            if (reader->map != NULL) {
+                size_t remaining = reader->map_len - reader->map_pos - data_len;
+                nbytes = remaining < read_chunk_size ? remaining : read_chunk_size;
+            } else {
+                if (batch->data_size - data_len < read_chunk_size) {
+                    resize_data(batch, batch->data_size * 2);
+                    data = batch->data;
+                }
+                nbytes = read_chunk(reader, data + data_len);
+            }
+
+            if (nbytes <= 0) {
+                reader->eof = true;
+                reader->error = nbytes < 0;
+            } else {
+                if (reader->newlines_size < reader->nnewlines + nbytes) {
+                    reader->newlines_size = reader->nnewlines + nbytes;
+                    reader->newlines = realloc(reader->newlines, sizeof (uint32_t) * reader->newlines_size);
+                }
+                reader->nnewlines += scan_newlines(data, data_len, data_len + nbytes, reader->newlines + reader->nnewlines);
+                data_len += nbytes;
+            }
+        }
+    }
+
+    // keep hold of any partial read at the end of the buffer, and the newlines in it, for the next batch
+    reader->carry_len = data_len - pos;
+    if (reader->map != NULL) {
+        reader->map_pos += pos;
+    } else {
+        if (reader->carry_size < reader->carry_len) {
+            reader->carry_size = reader->carry_len;
+            reader->carry = realloc(reader->carry, reader->carry_size);
+        }
+        memcpy(reader->carry, data + pos, reader->carry_len);
+        batch->data_len = pos;
+    }
+
+    reader->nnewlines -= nl;
+    size_t j;
+    for (j=0; j<reader->nnewlines; j++) {
+        reader->newlines[j] = reader->newlines[nl + j] - pos;
+    }
+
+    // the buffer may have moved while reading, so only point the reads into it now
+    if (reader->parse_headers && batch->fields == NULL) {
+        batch->fields = malloc(sizeof (HeaderFields) * batch_size);
+        pthread_mutex_lock(&free_lock);
+        add_memory_used(sizeof (HeaderFields) * batch_size);
+        pthread_mutex_unlock(&free_lock);
+    }
+    char* p = data;
+    for (i=0; i<batch->nreads; i++) {
+        FastqRead* read = &batch->reads[i];
+        read->header = p;
+        read->seq = read->header + read->header_len;
+        read->strand = read->seq + read->seq_len;
+        read->qual = read->strand + read->strand_len;
+        p = read->qual + read->qual_len;
+        if (reader->parse_headers && !parse_header(read->header, read->header_len, &batch->fields[i])) {
+            // stop at this read rather than filter it on fields that couldn't be found
+            reader->eof = true;
+            reader->error = true;
+            reader->error_reason = "a read header is over 64KB";
+            batch->nreads = i;
+            break;
+        }
+    }
+    return batch->nreads;
+}
@@ -0,0 +1,86 @@
+#ifndef FastqFilterer_fastq_h
+#define FastqFilterer_fastq_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "bgzf.h"
+#include "pool.h"
+
+#define batch_size 4096  // reads per batch
+
+
+/*
+ Where each field of an Illumina header is, as an offset from the start of the header and a length, which is 0 if
+ the field is missing. The header is taken to be in the form
+ '@instrument:run:flowcell:lane:tile:x:y read_number:filter_flag:control:index', where the read name runs up to
+ the first space, and each part is split on colons.
+ */
+typedef struct {
+    uint16_t start, len;
+} HeaderField;
+
+
+typedef struct {
+    HeaderField name, lane, tile, x, y, read_number, filter_flag, index;
+} HeaderFields;
+
+
+/*
+ A fastq entry, held as views into the data buffer of the ReadBatch it was parsed into, or into the input
+ file itself if it is memory-mapped. The four lines are contiguous, starting at header. Lines are not
+ null-terminated, and each line length includes its trailing '\n', if it has one.
+ */
+typedef struct {
+    char *header, *seq, *strand, *qual;
+    int header_len, seq_len, strand_len, qual_len;
+} FastqRead;
+
+
+/*
+ Up to batch_size consecutive reads from a fastq, along with the buffer they point into. A batch that has
+ been filled by a FastqReader owns its buffer; a batch built from another batch's reads (e.g. the reads to
+ be written to one output file, or the R1 reads of an interleaved batch) points to it as its source, and the
+ source is released once all refs to the batch have been released. If the reader was opened with parse_headers, fields[i] holds the parsed header of reads[i].
+ */
+typedef struct ReadBatch {
+    FastqRead* reads;
+    HeaderFields* fields;  // NULL unless headers are parsed
+    int nreads;
+    char* data;
+    size_t data_len, data_size;
+    struct ReadBatch* source;  // also links batches on the free list
+    int refs;
+} ReadBatch;
+
+
+typedef struct {
+    gzFile f;
+    BgzfReader* bgzf;  // used instead of f for BGZF input
+    char* map;  // used instead of f for uncompressed regular files
+    size_t map_len, map_pos;
+    char* carry;  // the start of a read left over at the end of the last batch (unused for a mapped file)
+    size_t carry_len, carry_size;  // for a mapped file, carry_len bytes after map_pos have been scanned
+    uint32_t* newlines;  // offsets of newlines found so far in the current batch's buffer, which must be < 2GB
+    size_t nnewlines, newlines_size;
+    bool parse_headers;
+    bool eof, error;
+    char* error_reason;  // why reading stopped with an error, if it wasn't an I/O error
+} FastqReader;
+
+
+ReadBatch* new_batch();
+ReadBatch* new_batch_of(ReadBatch* source);
+void free_batch(ReadBatch* batch);
+void release_batch(ReadBatch* batch);
+void split_interleaved(ReadBatch* batch, ReadBatch* r1_batch, ReadBatch* r2_batch);
+void free_batches();
+size_t batch_memory_peak();
+
+FastqReader* fastq_open(char* path, ThreadPool* pool, bool parse_headers);
+int fastq_read_batch(FastqReader* reader, ReadBatch* batch);
+void fastq_close(FastqReader* reader);
+char* fastq_scanner_name();
+
+#endif
@@ -6,315 +6,1008 @@
 #include <getopt.h>
 #include <time.h>
 #include <stdbool.h>
-#include "uthash.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "idset.h"
+#include "queue.h"
+#include "fastq.h"
+#include "pool.h"
+#include "output.h"
 #include "filter.h"
 
 #define block_size 2048
-#define unsafe_block_size 4096
+#define prefetch_distance 8  // read pairs ahead
+#define queue_depth 8  // batches in flight between any two pipeline threads
 
 int threshold = -1;
 bool quiet = false;
 char *r1i_path = NULL, *r1o_path = NULL, *r1f_path = NULL;
 char *r2i_path = NULL, *r2o_path = NULL, *r2f_path = NULL;
 char *remove_reads_path = NULL;
-int read_pairs_checked = 0, read_pairs_removed = 0, read_pairs_remaining = 0;
+char *remove_reads_sorted_path = NULL;
+char* manifest_path = NULL;
 int trim_r1, trim_r2;
+int nthreads = 1;
+int compress_level = -1;
+ThreadPool* pool = NULL;
+AsyncMode async_mode = async_off;
+bool interleaved_in = false, interleaved_out = false;
+bool single_end = false;  // R1 only, with no R2 reader, batches or outputs at all
 char* remove_tiles;
 char** tiles_to_remove;
+unsigned char* tile_bitmap;  // bit n is set if tile n is to be removed
+int tile_bitmap_size = 0;  // in tiles
 
 
 static void _log(char* fmt_str, ...) {
+    // logs go to stderr, so that output fastqs can be written to stdout
     if (quiet) {
         return;
     }
     
     time_t t = time(NULL);
-    struct tm* now = localtime(&t);
+    struct tm now;
+    localtime_r(&t, &now);  // samples may log from several threads at once
     
-    printf(
-        "[%i-%i-%i %i:%i:%i][fastq_filterer] ",
-        now->tm_year + 1900, now->tm_mon + 1, now->tm_mday, now->tm_hour, now->tm_min,  now->tm_sec
+    fprintf(
+        stderr, "[%i-%i-%i %i:%i:%i][fastq_filterer] ",
+        now.tm_year + 1900, now.tm_mon + 1, now.tm_mday, now.tm_hour, now.tm_min,  now.tm_sec
     );
     va_list args;
     va_start(args, fmt_str);
-    vprintf(fmt_str, args);
+    vfprintf(stderr, fmt_str, args);
     va_end(args);
     
 }
 
 
-static char* readln_unsafe(gzFile* f) {
-    char* line = malloc(unsafe_block_size);
-    line[0] = '\0';
-    gzgets(f, line, unsafe_block_size);
-    return line;
+static size_t readln(gzFile f, char** line, size_t* line_size) {
+    /*
+     Read a line from a file into a buffer, which is grown as needed to allow reading of lines of any length.
+     Each time this function is called on a file, the next line is read into the same buffer, so nothing is
+     allocated per line.
+     
+     :input gzFile f: The file to read from
+     :output: the length of the line read, including its '\n', or 0 if no input is available.
+     */
+    
+    size_t len = 0;
+    while (true) {
+        if (*line_size - len < block_size) {
+            *line_size *= 2;
+            *line = realloc(*line, *line_size);
+        }
+        if (gzgets(f, *line + len, *line_size - len) == NULL) {
+            return len;
+        }
+        len += strlen(*line + len);
+        if (len > 0 && (*line)[len - 1] == '\n') {
+            return len;
+        }
+    }
 }
 
 
-static char* readln(gzFile* f) {
+/*
+ A set of input fastqs to filter, with its outputs and the counts that go in its stats file. A normal run has one
+ sample, taken from the command line. With --manifest, there is one for each line of the manifest, and each is
+ filtered as a task on the shared ThreadPool, with the criteria and their lookup tables shared between them.
+ */
+typedef struct {
+    Task task;  // must be first, so the task can be cast back to its sample
+    char *r1i_path, *r2i_path, *r1o_path, *r2o_path, *r1f_path, *r2f_path;
+    char* stats_file;  // NULL for no stats file
+    int read_pairs_checked, read_pairs_removed, read_pairs_remaining;
+    long long *criteria_checked, *criteria_failed;  // indexed like criteria
+    BloomCounts bloom_counts;
+    int exit_status;
+} Sample;
+
+
+/*
+ The read pairs of a batch, with the columns that criteria need laid out as arrays, so that each criterion can
+ check a whole batch in one tight loop. Header fields are only there if the reader was asked to parse them.
+ */
+typedef struct {
+    int npairs;
+    ReadBatch *r1, *r2;
+    Sample* sample;  // that the reads are from
+    int r1_seq_len[batch_size], r2_seq_len[batch_size];
+} PairBatch;
+
+
+static void fill_pair_batch(PairBatch* pairs, Sample* sample, ReadBatch* r1_batch, ReadBatch* r2_batch, int npairs) {
     /*
-     Read a line from a file. Each time this function is called on a file, the next
-     line is read. Memory is dynamically allocated to allow reading of lines of any
-     length.
-     
-     :input FILE* f: The file to read from
-     :output: char* line (the line read), or null '\0' string if no input is available.
+     For single-end reads, r2_batch is NULL, and r2_seq_len is left unset, so criteria must check for a missing R2.
      */
-    
-    int _block_size = block_size;
-    char* line = malloc(sizeof (char) * _block_size);
-    line[0] = '\0';
-    
-    do {
-        _block_size += block_size;
-        line = realloc(line, _block_size + 1);
-        char* _line_part = malloc(sizeof (char) * block_size);
-        _line_part[0] = '\0';
+    pairs->npairs = npairs;
+    pairs->sample = sample;
+    pairs->r1 = r1_batch;
+    pairs->r2 = r2_batch;
+    int i;
+    for (i=0; i<npairs; i++) {
+        pairs->r1_seq_len[i] = r1_batch->reads[i].seq_len;
+    }
+    if (r2_batch != NULL) {
+        for (i=0; i<npairs; i++) {
+            pairs->r2_seq_len[i] = r2_batch->reads[i].seq_len;
+        }
+    }
+}
 
-        if (gzgets(f, _line_part, block_size)) {
-            strcat(line, _line_part);
-            free(_line_part);
-        } else {
-            free(_line_part);
-            return line;
+
+static int parse_tile(char* tile_id, int tile_len) {
+    /*
+     Convert a tile ID to an integer, if it is written the one way that integer would be written back out, i.e.
+     all digits without leading zeros, so that comparing integers gives the same result as comparing strings.
+
+     :output: the tile number, or -1 if the tile ID is not in this form
+     */
+    if (tile_len == 0 || tile_len > 7 || (tile_id[0] == '0' && tile_len > 1)) {
+        return -1;
+    }
+    int tile = 0;
+    int i;
+    for (i=0; i<tile_len; i++) {
+        if (tile_id[i] < '0' || tile_id[i] > '9') {
+            return -1;
         }
-    } while (line[strlen(line) - 1] != '\n');
+        tile = tile * 10 + tile_id[i] - '0';
+    }
+    return tile;
+}
+
+
+/*
+ Each criterion is a check that a read pair must pass to be kept. A criterion checks a whole PairBatch at a
+ time, clearing keep[i] for each read pair i that fails it, and may skip pairs that have already been cleared.
+ Criteria are checked in the order given by criteria_order, so in effect each pair stops at the first one that
+ it fails. With --adaptive_criteria, this order is updated after each batch so that checks that are cheap and
+ often fail come first. With --criteria_stats, every criterion is checked for every read pair, so that the
+ number of read pairs failing each one is exact. Stateful criteria, which need to see every read pair in order,
+ are always checked for every read pair. Each sample counts the read pairs checked and failed by each criterion
+ for itself.
+ */
+typedef struct {
+    char* name;
+    void (*check)(PairBatch*, uint8_t* keep);
+    int cost;  // rough relative cost of one check
+    bool stateful;
+} Criterion;
+
+Criterion* criteria;
+int* criteria_order;
+int ncriteria = 0;
+bool criteria_stats = false, adaptive_criteria = false;
+bool parse_r1_headers = false, parse_r2_headers = false;  // whether any criteria need the fields of each header
+bool stop_filtering = false;  // set by a criterion that has found the run can't succeed, to stop at the next batch
+
 
-    return line;
+static void add_criterion(char* name, void (*check)(PairBatch*, uint8_t*), int cost, bool stateful) {
+    criteria = realloc(criteria, sizeof (Criterion) * (ncriteria + 1));
+    criteria_order = realloc(criteria_order, sizeof (int) * (ncriteria + 1));
+    Criterion c = {name, check, cost, stateful};
+    criteria[ncriteria] = c;
+    criteria_order[ncriteria] = ncriteria;
+    ncriteria++;
 }
 
 
-char* (*read_func)(gzFile*) = readln;
+static double criterion_score(Sample* sample, int idx) {
+    // expected cost of finding a failing read pair with this criterion, assuming an untried one always fails
+    long long checked = sample->criteria_checked[idx], failed = sample->criteria_failed[idx];
+    int cost = criteria[idx].cost;
+    if (failed == 0) {
+        return checked == 0 ? cost : cost * (double) (checked + 1);
+    }
+    return cost * (double) checked / failed;
+}
 
 
-typedef struct {
-    char *header, *seq, *strand, *qual;
-} FastqRead;
+static void reorder_criteria(Sample* sample) {
+    /*
+     Insertion sort criteria_order by score. There are only a handful of criteria, and the order rarely
+     changes between batches.
+     */
+    int i, j;
+    for (i=1; i<ncriteria; i++) {
+        int idx = criteria_order[i];
+        double score = criterion_score(sample, idx);
+        for (j=i; j>0 && criterion_score(sample, criteria_order[j - 1]) > score; j--) {
+            criteria_order[j] = criteria_order[j - 1];
+        }
+        criteria_order[j] = idx;
+    }
+}
 
 
-typedef struct {
-    FastqRead r1, r2;
-} FastqReadPair;
+static void std_check_reads(PairBatch* pairs, uint8_t* keep) {
+    // branchless, so that the compiler can vectorise it
+    int i;
+    if (pairs->r2 == NULL) {
+        for (i=0; i<pairs->npairs; i++) {
+            keep[i] &= pairs->r1_seq_len[i] > threshold;
+        }
+        return;
+    }
+    for (i=0; i<pairs->npairs; i++) {
+        keep[i] &= (pairs->r1_seq_len[i] > threshold) & (pairs->r2_seq_len[i] > threshold);
+    }
+}
 
 
-static char* get_tile_id(char* fastq_header) {
-    char* field;
-    field = strtok(fastq_header, ":");
+static bool tile_removed(char* header, HeaderField field) {
+    char* tile_id = header + field.start;
+    if (field.len == 0) {
+        return false;
+    }
+
+    int tile = parse_tile(tile_id, field.len);
+    if (tile >= 0) {
+        return tile < tile_bitmap_size && (tile_bitmap[tile >> 3] & (1 << (tile & 7)));
+    }
+
+    // not a plain tile number, so fall back to comparing it against each tile given as a string
     int i;
-    for (i=0; i<4; i++) {
-        field = strtok(NULL, ":");  // walk along the header 4 times to the tile ID
+    for (i=0; tiles_to_remove[i] != NULL; i++) {  // check for null terminator at end of remove_tiles
+        if (strlen(tiles_to_remove[i]) == field.len && memcmp(tiles_to_remove[i], tile_id, field.len) == 0) {
+            return true;
+        }
     }
-    return field;
+    return false;
 }
 
 
-bool (**criteria)(FastqReadPair);
-int ncriteria = 0;
+static void tile_check_reads(PairBatch* pairs, uint8_t* keep) {
+    int i;
+    for (i=0; i<pairs->npairs; i++) {
+        if (keep[i] && tile_removed(pairs->r1->reads[i].header, pairs->r1->fields[i].tile)) {
+            keep[i] = 0;
+        }
+    }
+}
+
+
+static bool is_y_flagged(char* header, HeaderField flag) {
+    return flag.len == 1 && header[flag.start] == 'Y';
+}
+
+
+static void filter_flag_check_reads(PairBatch* pairs, uint8_t* keep) {
+    // reads flagged 'Y' did not pass the sequencer's chastity filter
+    int i;
+    for (i=0; i<pairs->npairs; i++) {
+        if (is_y_flagged(pairs->r1->reads[i].header, pairs->r1->fields[i].filter_flag)
+                || (pairs->r2 != NULL && is_y_flagged(pairs->r2->reads[i].header, pairs->r2->fields[i].filter_flag))) {
+            keep[i] = 0;
+        }
+    }
+}
+
+
+IdSet* reads_to_remove;
+double bloom_fpr = 0;  // build a Bloom filter in front of reads_to_remove, if not 0
+
+
+static char* get_read_id(ReadBatch* batch, int i, int* id_len) {
+    // the read name, i.e. everything up to the first space, without the leading '@'
+    *id_len = batch->fields[i].name.len;
+    return batch->reads[i].header + batch->fields[i].name.start;
+}
+
+
+static void id_check_reads(PairBatch* pairs, uint8_t* keep) {
+    /*
+     Look up each read pair still being kept in reads_to_remove, starting to load the set's memory for pairs a
+     little further on in the meantime, so that the cache misses of several lookups overlap.
+     */
+    int i, id_len;
+    char* read_id;
+    for (i=0; i<pairs->npairs; i++) {
+        int ahead = i + prefetch_distance;
+        if (ahead < pairs->npairs && keep[ahead]) {
+            read_id = get_read_id(pairs->r1, ahead, &id_len);
+            idset_prefetch(reads_to_remove, read_id, id_len);
+        }
+        if (keep[i]) {
+            read_id = get_read_id(pairs->r1, i, &id_len);
+            if (idset_contains(reads_to_remove, read_id, id_len, &pairs->sample->bloom_counts)) {
+                keep[i] = 0;
+            }
+        }
+    }
+}
 
 
-static bool std_check_read(FastqReadPair read_pair) {
-    if ((strlen(read_pair.r1.seq) > threshold) && (strlen(read_pair.r2.seq) > threshold)) {
-        return true;
+static void std_include(FastqRead read, OutputFile* outfile) {
+    // the four lines of a read are contiguous, so write them in one go
+    output_write(outfile, read.header, read.header_len + read.seq_len + read.strand_len + read.qual_len);
+}
+
+
+static void _trim_include(FastqRead read, OutputFile* outfile, int trim_len) {
+    if (read.seq_len > trim_len + 1) {  // add 1 here to compensate for \n at end of line
+        output_write(outfile, read.header, read.header_len);
+        output_write(outfile, read.seq, trim_len);
+        output_write(outfile, "\n", 1);
+        output_write(outfile, read.strand, read.strand_len);
+        output_write(outfile, read.qual, read.qual_len < trim_len ? read.qual_len : trim_len);
+        output_write(outfile, "\n", 1);
     } else {
-        return false;
+        std_include(read, outfile);
     }
 }
 
 
-static bool tile_check_read(FastqReadPair read_pair) {
-    // get_tile_id will modify the string passed to it with strtok, so use a copy
-    char* _read_id = malloc(sizeof (char) * (strlen(read_pair.r1.header) + 1));
-    strcpy(_read_id, read_pair.r1.header);
-    char* tile_id = get_tile_id(_read_id);
-    int i = 0;
-    
-    char* comp = tiles_to_remove[i];
-    
-    bool ret_val = true;
-    while (comp != NULL) {  // check for null terminator at end of remove_tiles
-        if (strcmp(comp, tile_id) == 0) {
-            ret_val = false;
+/*
+ Write out the reads of a batch whose keep entries equal kept, or all of them if keep is NULL. These are
+ specialised for plain and trimmed output, so that the include function is inlined into the loop.
+ */
+#define DEFINE_WRITE_READS(name, include) \
+static void name(FastqRead* reads, int nreads, uint8_t* keep, uint8_t kept, OutputFile* outfile, int trim_len) { \
+    (void) trim_len;  /* only used by the trimming version */ \
+    int i; \
+    for (i=0; i<nreads; i++) { \
+        if (keep == NULL || keep[i] == kept) { \
+            include; \
+        } \
+    } \
+}
+
+DEFINE_WRITE_READS(write_reads, std_include(reads[i], outfile))
+DEFINE_WRITE_READS(write_reads_trimmed, _trim_include(reads[i], outfile, trim_len))
+
+typedef void (*WriteFunc)(FastqRead*, int, uint8_t*, uint8_t, OutputFile*, int);
+WriteFunc write_func_r1 = write_reads;
+WriteFunc write_func_r2 = write_reads;
+
+
+static void write_read_runs(FastqRead* reads, int nreads, uint8_t* keep, uint8_t kept, OutputFile* outfile, int trim_len) {
+    /*
+     As write_reads, for the reads of an input batch, which lie end to end in its buffer. Each run of consecutive
+     reads to write is written as a single range, from its first header to the end of its last quality line,
+     without looking at the reads in between.
+     */
+    (void) trim_len;  // runs are only written untrimmed
+    int i = 0, j;
+    while (i < nreads) {
+        for (; i < nreads && keep[i] != kept; i++);
+        for (j=i; j < nreads && keep[j] == kept; j++);
+        if (j > i) {
+            FastqRead* last = &reads[j - 1];
+            output_write(outfile, reads[i].header, last->qual + last->qual_len - reads[i].header);
         }
-        i++;
-        comp = tiles_to_remove[i];
+        i = j;
     }
-    
-    free(_read_id);
-    return ret_val;
 }
 
 
-typedef struct {
-    const char* key;
-    UT_hash_handle hh;
-} HashTable;
+static void write_interleaved(
+    FastqRead* r1_reads, FastqRead* r2_reads, int npairs, uint8_t* keep, uint8_t kept, OutputFile* outfile,
+    WriteFunc write_r1, WriteFunc write_r2
+) {
+    /*
+     As write_reads, for read pairs, writing each pair's R1 and then its R2 to the one file. Each read is written
+     through write_r1 or write_r2, trimmed to trim_r1 or trim_r2 if that is a trimming WriteFunc.
+     */
+    int i;
+    for (i=0; i<npairs; i++) {
+        if (keep == NULL || keep[i] == kept) {
+            write_r1(&r1_reads[i], 1, NULL, 0, outfile, trim_r1);
+            write_r2(&r2_reads[i], 1, NULL, 0, outfile, trim_r2);
+        }
+    }
+}
 
-HashTable* reads_to_remove;
-HashTable* mask;
 
+static bool read_failed(FastqReader* r1i, FastqReader* r2i) {
+    return r1i->error || (r2i != NULL && r2i->error);
+}
 
-static bool id_check_read(FastqReadPair read_pair) {
-    char* _read_id = malloc(sizeof (char) * (strlen(read_pair.r1.header) + 1));
-    strcpy(_read_id, read_pair.r1.header);
-    
-    char* coord_information = strtok(_read_id, " ");
-    
-    HASH_FIND_STR(reads_to_remove, coord_information, mask);
-    bool ret_val = true;
-    if (mask) {
-        ret_val = false;
+
+static void log_read_error(FastqReader* r1i, FastqReader* r2i) {
+    char* reason = r1i->error ? r1i->error_reason : r2i->error_reason;
+    if (reason != NULL) {
+        _log("Could not read input fastqs: %s\n", reason);
+    } else {
+        _log("Could not read input fastqs\n");
     }
-    free(_read_id);
-    return ret_val;
 }
 
 
-static void std_include(FastqRead read, FILE* outfile) {
-    fputs(read.header, outfile);
-    fputs(read.seq, outfile);
-    fputs(read.strand, outfile);
-    fputs(read.qual, outfile);
+static void log_mismatched_inputs(Sample* sample) {
+    if (interleaved_in) {
+        _log(
+            "Interleaved input fastq %s has an odd number of reads, from line %i\n", sample->r1i_path,
+            sample->read_pairs_checked * 8
+        );
+    } else {
+        _log(
+            "Input fastqs %s and %s have differing numbers of reads, from line %i\n", sample->r1i_path,
+            sample->r2i_path, sample->read_pairs_checked * 4
+        );
+    }
 }
 
 
-static void _trim_include(FastqRead read, FILE* outfile, int trim_len) {
-    if (strlen(read.seq) > trim_len + 1) {  // add 1 here to compensate for \n at end of line...
-        read.seq[trim_len] = '\n';  // ...but 0-indexing means we don't need to add 1 here
-        read.seq[trim_len + 1] = '\0';
-        read.qual[trim_len] = '\n';
-        read.qual[trim_len + 1] = '\0';
+static int count_kept(uint8_t* keep, int n) {
+    int i, nkept = 0;
+    for (i=0; i<n; i++) {
+        nkept += keep[i];
     }
-    std_include(read, outfile);
+    return nkept;
 }
 
-static void trim_include_r1(FastqRead read, FILE* outfile) {
-    _trim_include(read, outfile, trim_r1);
+
+static void check_read_pairs(PairBatch* pairs, uint8_t* keep) {
+    /*
+     Run every criterion over a batch of read pairs, leaving keep[i] set for each pair i that passes them all.
+     Criteria that need an exact count of failures are given their own mask to fill in, which is then combined.
+     */
+    uint8_t mask[batch_size];
+    int n = pairs->npairs;
+    long long *checked = pairs->sample->criteria_checked, *failed = pairs->sample->criteria_failed;
+    memset(keep, 1, n);
+    int i, j;
+    for (i=0; i<ncriteria; i++) {
+        int idx = criteria_order[i];
+        Criterion* c = &criteria[idx];
+        if (criteria_stats || c->stateful) {
+            memset(mask, 1, n);
+            c->check(pairs, mask);
+            checked[idx] += n;
+            failed[idx] += n - count_kept(mask, n);
+            for (j=0; j<n; j++) {
+                keep[j] &= mask[j];
+            }
+        } else {
+            int nkept = count_kept(keep, n);
+            if (nkept == 0) {
+                continue;
+            }
+            c->check(pairs, keep);
+            checked[idx] += nkept;
+            failed[idx] += nkept - count_kept(keep, n);
+        }
+    }
 }
 
 
-static void trim_include_r2(FastqRead read, FILE* outfile) {
-    _trim_include(read, outfile, trim_r2);
+/*
+ Specialised versions of check_read_pairs for the usual combinations of criteria, chosen by choose_check_func.
+ Each checks the threshold in one vectorised pass, then the remaining criteria for each read pair still kept in
+ a single loop, with the criteria that are turned off dropped by the compiler, rather than going through the
+ criteria table.
+ */
+#define DEFINE_CHECK_READ_PAIRS(name, check_tiles, check_reads) \
+static void name(PairBatch* pairs, uint8_t* keep) { \
+    int i, id_len; \
+    char* read_id; \
+    if (pairs->r2 == NULL) { \
+        for (i=0; i<pairs->npairs; i++) { \
+            keep[i] = pairs->r1_seq_len[i] > threshold; \
+        } \
+    } else { \
+        for (i=0; i<pairs->npairs; i++) { \
+            keep[i] = (pairs->r1_seq_len[i] > threshold) & (pairs->r2_seq_len[i] > threshold); \
+        } \
+    } \
+    if (!check_tiles && !check_reads) { \
+        return; \
+    } \
+    for (i=0; i<pairs->npairs; i++) { \
+        if (check_reads && i + prefetch_distance < pairs->npairs && keep[i + prefetch_distance]) { \
+            read_id = get_read_id(pairs->r1, i + prefetch_distance, &id_len); \
+            idset_prefetch(reads_to_remove, read_id, id_len); \
+        } \
+        if (!keep[i]) { \
+            continue; \
+        } \
+        if (check_tiles && tile_removed(pairs->r1->reads[i].header, pairs->r1->fields[i].tile)) { \
+            keep[i] = 0; \
+        } else if (check_reads) { \
+            read_id = get_read_id(pairs->r1, i, &id_len); \
+            keep[i] = !idset_contains(reads_to_remove, read_id, id_len, &pairs->sample->bloom_counts); \
+        } \
+    } \
 }
 
+DEFINE_CHECK_READ_PAIRS(check_threshold, false, false)
+DEFINE_CHECK_READ_PAIRS(check_threshold_tiles, true, false)
+DEFINE_CHECK_READ_PAIRS(check_threshold_reads, false, true)
+DEFINE_CHECK_READ_PAIRS(check_threshold_tiles_reads, true, true)
+
+void (*check_func)(PairBatch*, uint8_t*) = check_read_pairs;
+
+// make bench_filter builds a copy with GENERIC_CRITERIA defined, to time the criteria table against these loops
+#ifdef GENERIC_CRITERIA
+#define generic_criteria true
+#else
+#define generic_criteria false
+#endif
 
-void (*include_func_r1)(FastqRead, FILE*) = std_include;
-void (*include_func_r2)(FastqRead, FILE*) = std_include;
+
+static void choose_check_func() {
+    /*
+     Use a specialised check loop if the criteria are some combination of threshold, remove_tiles and
+     remove_reads, and nothing needs the criteria table's per-criterion counts. The loops check tiles before
+     reads, so if --remove_reads came first, keep to the table's order so the bloom filter stats are the same.
+     */
+    if (generic_criteria || criteria_stats || adaptive_criteria) {
+        return;
+    }
+    bool tiles = false, reads = false;
+    int i;
+    for (i=1; i<ncriteria; i++) {  // criteria[0] is always the threshold
+        if (strcmp(criteria[i].name, "remove_tiles") == 0 && !reads) {
+            tiles = true;
+        } else if (strcmp(criteria[i].name, "remove_reads") == 0) {
+            reads = true;
+        } else {
+            return;
+        }
+    }
+    if (tiles && reads) {
+        check_func = check_threshold_tiles_reads;
+    } else if (tiles) {
+        check_func = check_threshold_tiles;
+    } else if (reads) {
+        check_func = check_threshold_reads;
+    } else {
+        check_func = check_threshold;
+    }
+}
 
 
-static int filter_fastqs() {
+static int filter_fastqs(Sample* sample) {
     /*
-     Read two fastqs, R1 and R2, entry by entry, checking whether the R1 and R2 for each read
+     Read two fastqs, R1 and R2, batch by batch, checking whether the R1 and R2 for each read
      are both long enough, and output them to Rx_filtered.fastq if they are. If not, output them to
-     Rx_filtered_reads.fastq.
-     
-     :input char* r1_path: Path to R1.fastq input file
-     :input char* r1_filtered: Path to R1_filtered.fastq output file
-     :input char* r2_path: Path to R1.fastq input file
-     :input char* r2_filtered: Path to R1_filtered.fastq output file
+     Rx_filtered_reads.fastq. With --interleaved_in, R1 and R2 are read from alternate records of one fastq, and
+     with --interleaved_out, each output file has both reads of each pair. With --single_end, only R1 is read,
+     checked and written, and r2i, r2o, r2f and r2_batch are all NULL.
      */
     
-    gzFile* r1i = gzopen(r1i_path, "r");
-    gzFile* r2i = gzopen(r2i_path, "r");
-    FILE* r1o = fopen(r1o_path, "w");
-    FILE* r2o = fopen(r2o_path, "w");
-    FILE* r1f = fopen(r1f_path, "w");
-    FILE* r2f = fopen(r2f_path, "w");
+    FastqReader* r1i = fastq_open(sample->r1i_path, pool, parse_r1_headers || (interleaved_in && parse_r2_headers));
+    FastqReader* r2i = interleaved_in || single_end ? NULL : fastq_open(sample->r2i_path, pool, parse_r2_headers);
+    if (r1i == NULL || (r2i == NULL && !interleaved_in && !single_end)) {
+        _log("Could not open input fastqs\n");
+        fastq_close(r1i);
+        fastq_close(r2i);
+        return 1;
+    }
+    if (r1i->bgzf != NULL) {_log("Inflating BGZF blocks of %s with %s\n", sample->r1i_path, r1i->bgzf->backend->name);}
+    if (r2i != NULL && r2i->bgzf != NULL) {_log("Inflating BGZF blocks of %s with %s\n", sample->r2i_path, r2i->bgzf->backend->name);}
+    bool separate_r2 = !interleaved_out && !single_end;  // whether R2 has output files of its own
+    OutputFile* r1o = output_open(sample->r1o_path, compress_level, pool, async_mode);
+    OutputFile* r2o = separate_r2 ? output_open(sample->r2o_path, compress_level, pool, async_mode) : NULL;
+    OutputFile* r1f = output_open(sample->r1f_path, compress_level, pool, async_mode);
+    OutputFile* r2f = separate_r2 ? output_open(sample->r2f_path, compress_level, pool, async_mode) : NULL;
+    if (r1o == NULL || r1f == NULL || (separate_r2 && (r2o == NULL || r2f == NULL))) {
+        _log("Could not open output fastqs\n");
+        output_close(r1o);
+        output_close(r2o);
+        output_close(r1f);
+        output_close(r2f);
+        fastq_close(r1i);
+        fastq_close(r2i);
+        return 1;
+    }
     
-    FastqReadPair read_pair;
+    /*
+     Untrimmed reads can be written a run of reads at a time, as whole records straight from the input, unless R1
+     and R2 were interleaved there.
+     */
+    WriteFunc write_runs = interleaved_in ? write_reads : write_read_runs;
+    WriteFunc write_r1 = write_func_r1 == write_reads ? write_runs : write_func_r1;
+    WriteFunc write_r2 = write_func_r2 == write_reads ? write_runs : write_func_r2;
+    ReadBatch* interleaved_batch = interleaved_in ? new_batch() : NULL;
+    ReadBatch* r1_batch = interleaved_in ? new_batch_of(interleaved_batch) : new_batch();
+    ReadBatch* r2_batch = interleaved_in ? new_batch_of(interleaved_batch) : single_end ? NULL : new_batch();
+    PairBatch pairs;
+    uint8_t keep[batch_size];
+    int ret_val = 0;
     
     while (true) {
-        read_pair.r1.header = read_func(r1i);  // @read_1 1
-        read_pair.r1.seq = read_func(r1i);     // ATGCATGC
-        read_pair.r1.strand = read_func(r1i);  // +
-        read_pair.r1.qual = read_func(r1i);    // #--------
-
-        read_pair.r2.header = read_func(r2i);  // @read_1 2
-        read_pair.r2.seq = read_func(r2i);     // ATGCATGC
-        read_pair.r2.strand = read_func(r2i);  // -
-        read_pair.r2.qual = read_func(r2i);    // #--------
+        bool more;  // whether the input may have more reads after this batch
+        if (interleaved_in) {
+            more = fastq_read_batch(r1i, interleaved_batch) == batch_size;
+            split_interleaved(interleaved_batch, r1_batch, r2_batch);
+        } else {
+            fastq_read_batch(r1i, r1_batch);
+            if (r2i != NULL) {
+                fastq_read_batch(r2i, r2_batch);
+            }
+            more = r1_batch->nreads == batch_size;
+        }
         
-        if (*read_pair.r1.header == '\0' || *read_pair.r2.header == '\0') {
-            int ret_val = 0;
-            if (*read_pair.r1.header != *read_pair.r2.header) {  // if either file is not finished
-                _log("Input fastqs have differing numbers of reads, from line %i\n", read_pairs_checked * 4);
-                ret_val = 1;
+        int npairs = r1_batch->nreads;
+        if (r2_batch != NULL && r2_batch->nreads < npairs) {
+            npairs = r2_batch->nreads;
+        }
+        fill_pair_batch(&pairs, sample, r1_batch, r2_batch, npairs);
+        check_func(&pairs, keep);
+        int nkept = count_kept(keep, npairs);
+        sample->read_pairs_checked += npairs;
+        sample->read_pairs_remaining += nkept;
+        sample->read_pairs_removed += npairs - nkept;
+        
+        if (interleaved_out) {
+            write_interleaved(r1_batch->reads, r2_batch->reads, npairs, keep, 1, r1o, write_func_r1, write_func_r2);
+            write_interleaved(r1_batch->reads, r2_batch->reads, npairs, keep, 0, r1f, write_reads, write_reads);
+        } else {
+            write_r1(r1_batch->reads, npairs, keep, 1, r1o, trim_r1);
+            write_runs(r1_batch->reads, npairs, keep, 0, r1f, 0);
+        }
+        if (separate_r2) {
+            write_r2(r2_batch->reads, npairs, keep, 1, r2o, trim_r2);
+            write_runs(r2_batch->reads, npairs, keep, 0, r2f, 0);
+        }
+        if (adaptive_criteria) {
+            reorder_criteria(sample);
+        }
+        
+        // the batches' buffers will be reused for the next batch, so write out everything that points to them
+        output_flush(r1o);
+        output_flush(r1f);
+        if (separate_r2) {
+            output_flush(r2o);
+            output_flush(r2f);
+        }
+        
+        if (stop_filtering) {
+            ret_val = 1;
+            break;
+        } else if (r2_batch != NULL && r1_batch->nreads != r2_batch->nreads) {  // if either file is not finished
+            if (!read_failed(r1i, r2i)) {  // a failed read is logged below instead
+                log_mismatched_inputs(sample);
             }
-            
-            free(read_pair.r1.header);
-            free(read_pair.r1.seq);
-            free(read_pair.r1.strand);
-            free(read_pair.r1.qual);
-            
-            free(read_pair.r2.header);
-            free(read_pair.r2.seq);
-            free(read_pair.r2.strand);
-            free(read_pair.r2.qual);
-            
-            gzclose(r1i);
-            gzclose(r2i);
-            fclose(r1o);
-            fclose(r2o);
-            fclose(r1f);
-            fclose(r2f);
-
-            return ret_val;
+            ret_val = 1;
+            break;
+        } else if (!more) {
+            break;
+        }
+    }
+    
+    if (read_failed(r1i, r2i)) {
+        log_read_error(r1i, r2i);
+        ret_val = 1;
+    }
+    
+    if (output_close(r1o) + output_close(r2o) + output_close(r1f) + output_close(r2f) != 0) {
+        _log("Could not write output fastqs\n");
+        ret_val = 1;
+    }
+    free_batch(r1_batch);
+    if (r2_batch != NULL) {
+        free_batch(r2_batch);
+    }
+    if (interleaved_batch != NULL) {
+        free_batch(interleaved_batch);
+    }
+    fastq_close(r1i);
+    fastq_close(r2i);
+    
+    return ret_val;
+}
+
+
+/*
+ Threaded pipeline, used with --threads > 1. R1 and R2 are each read by their own thread, read pairs are
+ checked in batches on a filter thread, and each of the four output files is written by its own thread.
+ Stages are linked by bounded queues of ReadBatches, each of which has a single producer and a single
+ consumer, so batches - and therefore reads - are output in the same order as they were read in. Output
+ batches point into the input batches, which are released once both of their output batches are written.
+ 
+ An interleaved input is read by one thread, which splits each batch into R1 and R2 batches pointing into it.
+ For interleaved output, there is one writer for each pair of R1 and R2 output queues. Single-end runs have no
+ R2 queues or threads at all.
+ */
+typedef struct {
+    FastqReader* f;
+    Queue *out, *out2;  // out2 is for the R2 batches of an interleaved input, otherwise NULL
+} ReaderArgs;
+
+
+typedef struct {
+    Queue *in, *in2;  // in2 is for the R2 batches to interleave with in's R1 batches, otherwise NULL
+    OutputFile* f;
+    WriteFunc write_func, write_func2;
+    int trim_len;
+} WriterArgs;
+
+
+typedef struct {
+    Queue *r1i, *r2i, *r1o, *r2o, *r1f, *r2f;
+    Sample* sample;
+    FastqReader *r1_reader, *r2_reader;  // only to tell a failed read from inputs of differing lengths
+    int ret_val;
+} FilterArgs;
+
+
+static void* reader_thread(void* _args) {
+    ReaderArgs* args = _args;
+    
+    int nreads = batch_size;
+    while (nreads == batch_size) {
+        ReadBatch* batch = new_batch();
+        nreads = fastq_read_batch(args->f, batch);
+        if (nreads == 0) {
+            free_batch(batch);
+        } else if (args->out2 != NULL) {
+            batch->refs = 2;
+            ReadBatch* r1_batch = new_batch_of(batch);
+            ReadBatch* r2_batch = new_batch_of(batch);
+            split_interleaved(batch, r1_batch, r2_batch);
+            queue_push(args->out, r1_batch);
+            queue_push(args->out2, r2_batch);
+        } else {
+            queue_push(args->out, batch);  // once pushed, the batch belongs to the filter thread
+        }
+    }
+    
+    queue_close(args->out);
+    if (args->out2 != NULL) {
+        queue_close(args->out2);
+    }
+    return NULL;
+}
+
 
+static void* writer_thread(void* _args) {
+    WriterArgs* args = _args;
+    ReadBatch* batch;
+    
+    while ((batch = queue_pop(args->in)) != NULL) {
+        if (args->in2 == NULL) {
+            args->write_func(batch->reads, batch->nreads, NULL, 0, args->f, args->trim_len);
+            output_flush(args->f);
         } else {
-            bool read_included = true;
-            int i;
-            for (i=0; i<ncriteria + 1; i++) {
-                bool (*func)(FastqReadPair) = criteria[i];
-                //if (criteria[i](read_pair) == false) {
-                if (func(read_pair) == false) {
-                    read_included = false;
-                    //break;
+            ReadBatch* r2_batch = queue_pop(args->in2);  // always pushed along with its R1 batch
+            write_interleaved(
+                batch->reads, r2_batch->reads, batch->nreads, NULL, 0, args->f, args->write_func, args->write_func2
+            );
+            output_flush(args->f);
+            release_batch(r2_batch);
+        }
+        release_batch(batch);
+    }
+    return NULL;
+}
+
+
+static void drain_queue(Queue* q) {
+    ReadBatch* batch;
+    while (q != NULL && (batch = queue_pop(q)) != NULL) {
+        release_batch(batch);
+    }
+}
+
+
+static void partition_reads(ReadBatch* batch, uint8_t* keep, int nreads, ReadBatch* kept, ReadBatch* removed) {
+    // add each of the first nreads reads of a batch to kept or removed, according to keep
+    int i;
+    for (i=0; i<nreads; i++) {
+        ReadBatch* out = keep[i] ? kept : removed;
+        out->reads[out->nreads++] = batch->reads[i];
+    }
+}
+
+
+static void* filter_thread(void* _args) {
+    FilterArgs* args = _args;
+    ReadBatch *r1_batch, *r2_batch;
+    PairBatch pairs;
+    uint8_t keep[batch_size];
+    args->ret_val = 0;
+    
+    while (true) {
+        r1_batch = queue_pop(args->r1i);
+        r2_batch = args->r2i == NULL ? NULL : queue_pop(args->r2i);
+        if (r1_batch == NULL || (args->r2i != NULL && r2_batch == NULL)) {
+            if (r1_batch != r2_batch) {  // one file has run out before the other
+                if (!read_failed(args->r1_reader, args->r2_reader)) {
+                    log_mismatched_inputs(args->sample);
                 }
+                args->ret_val = 1;
+                release_batch(r1_batch == NULL ? r2_batch : r1_batch);
+                drain_queue(args->r1i);
+                drain_queue(args->r2i);
             }
-            
-            read_pairs_checked++;
-            if (read_included == true) {
-                // include reads
-                read_pairs_remaining++;
-            
-                include_func_r1(read_pair.r1, r1o);
-                include_func_r2(read_pair.r2, r2o);
-            } else {
-                // exclude reads
-                read_pairs_removed++;
-                
-                std_include(read_pair.r1, r1f);
-                std_include(read_pair.r2, r2f);
-            }
+            break;
+        }
+        
+        // each input batch is referenced by two output batches, e.g. R1 -> r1o and r1f
+        r1_batch->refs = 2;
+        ReadBatch* r1o_batch = new_batch_of(r1_batch);
+        ReadBatch* r1f_batch = new_batch_of(r1_batch);
+        int npairs = r1_batch->nreads;
+        if (r2_batch != NULL && r2_batch->nreads < npairs) {
+            npairs = r2_batch->nreads;
         }
+        bool mismatched = r2_batch != NULL && r1_batch->nreads != r2_batch->nreads;  // before any batch is pushed
         
-        free(read_pair.r1.header);
-        free(read_pair.r1.seq);
-        free(read_pair.r1.strand);
-        free(read_pair.r1.qual);
+        fill_pair_batch(&pairs, args->sample, r1_batch, r2_batch, npairs);
+        check_func(&pairs, keep);
+        int nkept = count_kept(keep, npairs);
+        args->sample->read_pairs_checked += npairs;
+        args->sample->read_pairs_remaining += nkept;
+        args->sample->read_pairs_removed += npairs - nkept;
+        partition_reads(r1_batch, keep, npairs, r1o_batch, r1f_batch);
+        queue_push(args->r1o, r1o_batch);
+        queue_push(args->r1f, r1f_batch);
         
-        free(read_pair.r2.header);
-        free(read_pair.r2.seq);
-        free(read_pair.r2.strand);
-        free(read_pair.r2.qual);
+        if (r2_batch != NULL) {
+            r2_batch->refs = 2;
+            ReadBatch* r2o_batch = new_batch_of(r2_batch);
+            ReadBatch* r2f_batch = new_batch_of(r2_batch);
+            partition_reads(r2_batch, keep, npairs, r2o_batch, r2f_batch);
+            queue_push(args->r2o, r2o_batch);
+            queue_push(args->r2f, r2f_batch);
+        }
+        if (adaptive_criteria) {
+            reorder_criteria(args->sample);
+        }
+        
+        if (stop_filtering) {
+            args->ret_val = 1;
+            drain_queue(args->r1i);
+            drain_queue(args->r2i);
+            break;
+        } else if (mismatched) {
+            if (!read_failed(args->r1_reader, args->r2_reader)) {
+                log_mismatched_inputs(args->sample);
+            }
+            args->ret_val = 1;
+            drain_queue(args->r1i);
+            drain_queue(args->r2i);
+            break;
+        }
+    }
+    
+    queue_close(args->r1o);
+    queue_close(args->r1f);
+    if (args->r2i != NULL) {
+        queue_close(args->r2o);
+        queue_close(args->r2f);
     }
+    return NULL;
 }
 
 
-static char* build_output_path(char* input_path, char* new_extension) {
+static int filter_fastqs_threaded(Sample* sample) {
     /*
-     Convert, e.g, basename.fastq to basename_filtered.fastq. Used when output fastq paths are not specified.
+     As filter_fastqs, but running each stage of the process on its own thread.
      */
     
-    int file_ext_len = 6;  // .fastq
+    FastqReader* r1i = fastq_open(sample->r1i_path, pool, parse_r1_headers || (interleaved_in && parse_r2_headers));
+    FastqReader* r2i = interleaved_in || single_end ? NULL : fastq_open(sample->r2i_path, pool, parse_r2_headers);
+    if (r1i == NULL || (r2i == NULL && !interleaved_in && !single_end)) {
+        _log("Could not open input fastqs\n");
+        fastq_close(r1i);
+        fastq_close(r2i);
+        return 1;
+    }
+    if (r1i->bgzf != NULL) {_log("Inflating BGZF blocks of %s in parallel with %s\n", sample->r1i_path, r1i->bgzf->backend->name);}
+    if (r2i != NULL && r2i->bgzf != NULL) {_log("Inflating BGZF blocks of %s in parallel with %s\n", sample->r2i_path, r2i->bgzf->backend->name);}
+    bool separate_r2 = !interleaved_out && !single_end;  // whether R2 has output files of its own
+    OutputFile* r1o = output_open(sample->r1o_path, compress_level, pool, async_mode);
+    OutputFile* r2o = separate_r2 ? output_open(sample->r2o_path, compress_level, pool, async_mode) : NULL;
+    OutputFile* r1f = output_open(sample->r1f_path, compress_level, pool, async_mode);
+    OutputFile* r2f = separate_r2 ? output_open(sample->r2f_path, compress_level, pool, async_mode) : NULL;
+    if (r1o == NULL || r1f == NULL || (separate_r2 && (r2o == NULL || r2f == NULL))) {
+        _log("Could not open output fastqs\n");
+        output_close(r1o);
+        output_close(r2o);
+        output_close(r1f);
+        output_close(r2f);
+        fastq_close(r1i);
+        fastq_close(r2i);
+        return 1;
+    }
     
-    if (input_path[strlen(input_path) - 1] == 'z') {
-        file_ext_len = 9;  // .fastq.gz
+    FilterArgs filter_args = {
+        queue_new(queue_depth), single_end ? NULL : queue_new(queue_depth),
+        queue_new(queue_depth), single_end ? NULL : queue_new(queue_depth),
+        queue_new(queue_depth), single_end ? NULL : queue_new(queue_depth),
+        sample, r1i, r2i, 0
+    };
+    ReaderArgs reader_args[2] = {{r1i, filter_args.r1i, NULL}, {r2i, filter_args.r2i, NULL}};
+    WriterArgs writer_args[4] = {
+        {filter_args.r1o, NULL, r1o, write_func_r1, NULL, trim_r1},
+        {filter_args.r2o, NULL, r2o, write_func_r2, NULL, trim_r2},
+        {filter_args.r1f, NULL, r1f, write_reads, NULL, 0},
+        {filter_args.r2f, NULL, r2f, write_reads, NULL, 0}
+    };
+    int nreaders = 2, nwriters = 4;
+    if (interleaved_in) {
+        reader_args[0].out2 = filter_args.r2i;
+        nreaders = 1;
+    }
+    if (single_end) {
+        writer_args[1] = writer_args[2];
+        nreaders = 1;
+        nwriters = 2;
+    }
+    if (interleaved_out) {
+        writer_args[0].in2 = filter_args.r2o;
+        writer_args[0].write_func2 = write_func_r2;
+        writer_args[1] = writer_args[2];
+        writer_args[1].in2 = filter_args.r2f;
+        writer_args[1].write_func2 = write_reads;
+        nwriters = 2;
+    }
+    
+    pthread_t readers[2], writers[4], filter;
+    int i;
+    for (i=0; i<nreaders; i++) {
+        pthread_create(&readers[i], NULL, reader_thread, &reader_args[i]);
+    }
+    for (i=0; i<nwriters; i++) {
+        pthread_create(&writers[i], NULL, writer_thread, &writer_args[i]);
+    }
+    pthread_create(&filter, NULL, filter_thread, &filter_args);
+    
+    for (i=0; i<nreaders; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    pthread_join(filter, NULL);
+    for (i=0; i<nwriters; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    
+    if (read_failed(r1i, r2i)) {
+        log_read_error(r1i, r2i);
+        filter_args.ret_val = 1;
+    }
+    
+    queue_free(filter_args.r1i);
+    queue_free(filter_args.r2i);
+    queue_free(filter_args.r1o);
+    queue_free(filter_args.r2o);
+    queue_free(filter_args.r1f);
+    queue_free(filter_args.r2f);
+    
+    if (output_close(r1o) + output_close(r2o) + output_close(r1f) + output_close(r2f) != 0) {
+        _log("Could not write output fastqs\n");
+        filter_args.ret_val = 1;
+    }
+    fastq_close(r1i);
+    fastq_close(r2i);
+    
+    return filter_args.ret_val;
+}
+
+
+static bool has_extension(char* path, char* extension) {
+    size_t len = strlen(path), ext_len = strlen(extension);
+    return len > ext_len && strcmp(path + len - ext_len, extension) == 0;
+}
+
+
+static char* build_output_path(char* input_path, char* read, char* new_extension) {
+    /*
+     Convert, e.g, basename.fastq to basename_filtered.fastq, or to basename_R1_filtered.fastq with a read of
+     "_R1". Used when output fastq paths are not specified.
+
+     :output: the output path, or NULL if the input isn't named like a fastq, e.g. "-" for stdin or /dev/fd/N
+     */
+    
+    int file_ext_len;
+    if (has_extension(input_path, ".fastq")) {
+        file_ext_len = 6;
+    } else if (has_extension(input_path, ".fastq.gz")) {
+        file_ext_len = 9;
+    } else {
+        return NULL;
     }
     
     size_t basename_len = strlen(input_path) - file_ext_len;
-    char* output_path = malloc(sizeof (char) * (basename_len + strlen(new_extension) + 1));
+    char* output_path = malloc(sizeof (char) * (basename_len + strlen(read) + strlen(new_extension) + 1));
     strncpy(output_path, input_path, basename_len);
     output_path[basename_len] = '\0';
+    strcat(output_path, read);
     strcat(output_path, new_extension);
     return output_path;
 }
@@ -340,13 +1033,54 @@ static void build_remove_tiles() {
     char* field;
     field = strtok(rm_tiles, ",");
     while (field != NULL) {
-        tiles_to_remove[i] = malloc(sizeof (char) * strlen(field) + 1);
-        strcpy(tiles_to_remove[i], field);
+        tiles_to_remove[i] = field;  // tile IDs point into rm_tiles, which is kept for the rest of the run
         field = strtok(NULL, ",");
         i++;
     }
     tiles_to_remove[i] = NULL;  // set a null terminator
-    free(rm_tiles);
+
+    // precompute a bitmap of tile numbers, so that checking a read is O(1) however many tiles there are
+    for (i=0; tiles_to_remove[i] != NULL; i++) {
+        int tile = parse_tile(tiles_to_remove[i], strlen(tiles_to_remove[i]));
+        if (tile >= tile_bitmap_size) {
+            tile_bitmap_size = tile + 1;
+        }
+    }
+    tile_bitmap = calloc((tile_bitmap_size + 7) / 8 + 1, 1);
+    for (i=0; tiles_to_remove[i] != NULL; i++) {
+        int tile = parse_tile(tiles_to_remove[i], strlen(tiles_to_remove[i]));
+        if (tile >= 0) {
+            tile_bitmap[tile >> 3] |= 1 << (tile & 7);
+        }
+    }
+}
+
+
+static char* parse_remove_reads_line(char* line, size_t len, int* id_len) {
+    /*
+     Find the read ID in a line of a --remove_reads file, i.e. up to the first space, or the end of the line if
+     there isn't one.
+
+     :output: the start of the read ID, or NULL if there isn't one, e.g. for a blank line
+     */
+    char* end = line + len;
+    char delimiter = memchr(line, ' ', len) == NULL ? '\n' : ' ';
+    char* read_id = line;
+    while (read_id < end && *read_id == delimiter) {
+        read_id++;
+    }
+    char* read_id_end = read_id;
+    while (read_id_end < end && *read_id_end != delimiter) {
+        read_id_end++;
+    }
+    *id_len = read_id_end - read_id;
+    return read_id_end > read_id ? read_id : NULL;
+}
+
+
+static gzFile open_list(char* path) {
+    // open a list of read IDs, which may be gzipped, or stdin if the path is "-"
+    return strcmp(path, "-") == 0 ? gzdopen(dup(STDIN_FILENO), "r") : gzopen(path, "r");
 }
 
 
@@ -355,58 +1089,206 @@ static void build_remove_reads() {
         return;
     }
     
-    gzFile* rm_reads = gzopen(remove_reads_path, "r");
-    reads_to_remove = NULL;
-    mask = NULL;
-    int i = 0;
-    char* matchable_element;
-    char* read_id;
-    char* line;
+    bool is_index;
+    reads_to_remove = idset_map(remove_reads_path, &is_index);  // an index built with index_reads, if it is one
+    if (reads_to_remove != NULL) {
+        return;
+    } else if (is_index) {
+        _log("%s is not a valid index file - it may be truncated, so run index_reads again\n", remove_reads_path);
+        exit(1);
+    }
     
-    while (true) {
-        line = readln(rm_reads);
-        if (line == NULL || *line == '\0') {
-            gzclose(rm_reads);
+    gzFile rm_reads = open_list(remove_reads_path);
+    if (rm_reads == NULL) {
+        _log("Could not open %s\n", remove_reads_path);
+        exit(1);
+    }
+    reads_to_remove = idset_new();
+    size_t line_size = block_size;
+    char* line = malloc(sizeof (char) * line_size);
+    size_t len;
+    
+    while ((len = readln(rm_reads, &line, &line_size)) > 0) {
+        int id_len;
+        char* read_id = parse_remove_reads_line(line, len, &id_len);
+        if (read_id != NULL) {
+            idset_add(reads_to_remove, read_id, id_len);
+        }
+    }
+    free(line);
+    gzclose(rm_reads);
+}
+
+
+/*
+ With --remove_reads_sorted, the reads to remove are listed in the same order that they appear in the input, so
+ rather than loading them all into a set, the list is read one ID at a time, moving on to the next each time a
+ read pair matches the current one. Memory use is therefore constant, however long the list is. The ID after the
+ current one is also kept, so that if the input reaches it first, the list is known to be out of order there and
+ then, and filtering stops. Any ID left over at the end was either missing from the input or out of order, so the
+ run fails either way.
+ */
+typedef struct {
+    char* line;
+    size_t line_size;
+    char* read_id;  // NULL once the list is finished
+    int read_id_len;
+    long long line_number;
+} SortedEntry;
+
+gzFile sorted_reads;
+SortedEntry sorted_entries[2];  // the next read to remove, and the one after it
+SortedEntry *sorted_current = &sorted_entries[0], *sorted_next = &sorted_entries[1];
+long long sorted_lines_read = 0;
+
+
+static void read_sorted_entry(SortedEntry* entry) {
+    size_t len;
+    while ((len = readln(sorted_reads, &entry->line, &entry->line_size)) > 0) {
+        entry->line_number = ++sorted_lines_read;
+        entry->read_id = parse_remove_reads_line(entry->line, len, &entry->read_id_len);
+        if (entry->read_id != NULL) {
             return;
         }
+    }
+    entry->read_id = NULL;
+}
 
-        // match up to the first space
-        char* space_match = strchr(line, ' ');
-        if (space_match == NULL) {
-            read_id = strtok(line, "\n");
-        } else {
-            read_id = strtok(line, " ");
+
+static void next_sorted_read() {
+    // the entry after the current one becomes current, and its old buffer is reused for the one after that
+    SortedEntry* done = sorted_current;
+    sorted_current = sorted_next;
+    sorted_next = done;
+    read_sorted_entry(sorted_next);
+}
+
+
+static void open_remove_reads_sorted() {
+    sorted_reads = open_list(remove_reads_sorted_path);
+    if (sorted_reads == NULL) {
+        _log("Could not open %s\n", remove_reads_sorted_path);
+        exit(1);
+    }
+    int i;
+    for (i=0; i<2; i++) {
+        sorted_entries[i].line_size = block_size;
+        sorted_entries[i].line = malloc(sizeof (char) * sorted_entries[i].line_size);
+        read_sorted_entry(&sorted_entries[i]);
+    }
+}
+
+
+static bool matches_sorted_entry(SortedEntry* entry, char* read_id, int id_len) {
+    return entry->read_id != NULL && id_len == entry->read_id_len && memcmp(read_id, entry->read_id, id_len) == 0;
+}
+
+
+static void sorted_check_reads(PairBatch* pairs, uint8_t* keep) {
+    int i, id_len;
+    for (i=0; i<pairs->npairs && sorted_current->read_id != NULL && !stop_filtering; i++) {
+        char* read_id = get_read_id(pairs->r1, i, &id_len);
+        if (matches_sorted_entry(sorted_current, read_id, id_len)) {
+            keep[i] = 0;
+            next_sorted_read();
+        } else if (matches_sorted_entry(sorted_next, read_id, id_len)) {
+            _log(
+                "Read %.*s on line %lli of %s was found in the input before read %.*s on line %lli - the list must "
+                "be in the same order as the input fastqs\n", id_len, read_id, sorted_next->line_number,
+                remove_reads_sorted_path, sorted_current->read_id_len, sorted_current->read_id,
+                sorted_current->line_number
+            );
+            stop_filtering = true;
         }
-        
-        if (read_id != NULL) {  // this can happen if there's a blank line in the file, i.e. '\n'
-            matchable_element = malloc(sizeof (char) * strlen(read_id) + 2);  // include the @ and \0
-            strcpy(matchable_element, "@");
-            strcat(matchable_element, read_id);
-            matchable_element[strlen(matchable_element)] = '\0';
+    }
+}
+
 
-            mask = malloc(sizeof (*mask));
-            mask->key = matchable_element;
-            HASH_ADD_KEYPTR(hh, reads_to_remove, mask->key, strlen(mask->key), mask);
-            i++;
+static int close_remove_reads_sorted() {
+    /*
+     :output: 0 if every read in the list was found in the input, otherwise 1
+     */
+    int ret_val = stop_filtering;
+    if (sorted_current->read_id != NULL && !stop_filtering) {
+        _log(
+            "Read %.*s on line %lli of %s was not found in the input in order - the list must be in the same order "
+            "as the input fastqs\n", sorted_current->read_id_len, sorted_current->read_id,
+            sorted_current->line_number, remove_reads_sorted_path
+        );
+        ret_val = 1;
+    }
+    int i;
+    for (i=0; i<2; i++) {
+        free(sorted_entries[i].line);
+    }
+    gzclose(sorted_reads);
+    return ret_val;
+}
+
+
+static void remove_outputs(Sample* sample) {
+    // delete a failed run's output files, so they can't be mistaken for good ones. Streams and pipes are left alone.
+    char* paths[4] = {sample->r1o_path, sample->r2o_path, sample->r1f_path, sample->r2f_path};
+    int i;
+    for (i=0; i<4; i++) {
+        struct stat st;
+        if (paths[i] != NULL && strcmp(paths[i], "-") != 0 && stat(paths[i], &st) == 0 && S_ISREG(st.st_mode)) {
+            _log("Removing output %s\n", paths[i]);
+            unlink(paths[i]);
         }
-        free(line);
     }
 }
 
 
-static void output_stats(char* stats_file) {
-    FILE* f = fopen(stats_file, "w");
-    
-    fprintf(
-        f,
-        "r1i %s\nr1o %s\nr2i %s\nr2o %s\nr1f %s\nr2f %s\n",
-        r1i_path, r1o_path, r2i_path, r2o_path, r1f_path, r2f_path
+static int index_reads(char* rm_reads_path, char* index_path) {
+    /*
+     Build the set of read IDs to remove from a text file, as --remove_reads would, and write it out as an index
+     file that can be passed to --remove_reads instead, which maps it rather than building it again.
+     */
+    remove_reads_path = rm_reads_path;
+    build_remove_reads();
+    if (idset_write(reads_to_remove, index_path) != 0) {
+        _log("Could not write index file %s\n", index_path);
+        return 1;
+    }
+    _log(
+        "Indexed %llu read IDs from %s into %s (%zu bytes)\n",
+        (unsigned long long) (reads_to_remove->nkeys + reads_to_remove->npacked), rm_reads_path, index_path,
+        idset_memory(reads_to_remove)
     );
+    idset_free(reads_to_remove);
+    return 0;
+}
+
+
+static int output_stats(Sample* sample) {
+    /*
+     Write a sample's stats file, or to stdout if its path is "-". The stats are built up in memory, then written
+     through an OutputFile like the fastq outputs.
+
+     :output: 0 on success, otherwise non-zero
+     */
+    char* stats;
+    size_t stats_len;
+    FILE* f = open_memstream(&stats, &stats_len);
+    
+    if (single_end) {
+        fprintf(f, "r1i %s\nr1o %s\nr1f %s\nsingle_end 1\n", sample->r1i_path, sample->r1o_path, sample->r1f_path);
+    } else {
+        fprintf(
+            f,
+            "r1i %s\nr1o %s\nr2i %s\nr2o %s\nr1f %s\nr2f %s\n",
+            sample->r1i_path, sample->r1o_path, sample->r2i_path, sample->r2o_path, sample->r1f_path, sample->r2f_path
+        );
+    }
     fprintf(
         f,
         "read_pairs_checked %i\nread_pairs_removed %i\nread_pairs_remaining %i\n",
-        read_pairs_checked, read_pairs_removed, read_pairs_remaining
+        sample->read_pairs_checked, sample->read_pairs_removed, sample->read_pairs_remaining
     );
+    if (manifest_path == NULL) {  // batches are shared between a manifest's samples, so have no per-sample peak
+        fprintf(f, "batch_memory_peak %zu\n", batch_memory_peak());
+    }
     
     if (trim_r1) {
         fprintf(f, "trim_r1 %i\n", trim_r1);
@@ -419,9 +1301,165 @@ static void output_stats(char* stats_file) {
     }
     if (remove_reads_path) {
         fprintf(f, "remove_reads %s\n", remove_reads_path);
+        fprintf(f, "remove_reads_count %llu\n", (unsigned long long) (reads_to_remove->nkeys + reads_to_remove->npacked));
+        fprintf(f, "remove_reads_packed %llu\n", (unsigned long long) reads_to_remove->npacked);
+        fprintf(f, "remove_reads_memory %zu\n", idset_memory(reads_to_remove));
+        if (reads_to_remove->bloom != NULL) {
+            BloomCounts* bloom = &sample->bloom_counts;
+            fprintf(
+                f, "bloom_checked %llu\nbloom_rejected %llu\nbloom_false_positives %llu\n",
+                (unsigned long long) bloom->checked, (unsigned long long) bloom->rejected,
+                (unsigned long long) bloom->false_positives
+            );
+        }
+    }
+    if (remove_reads_sorted_path) {
+        fprintf(f, "remove_reads_sorted %s\n", remove_reads_sorted_path);
+    }
+    if (criteria_stats) {
+        int i;
+        for (i=0; i<ncriteria; i++) {
+            fprintf(f, "failed_%s %lli\n", criteria[i].name, sample->criteria_failed[i]);
+        }
     }
     
     fclose(f);
+    OutputFile* out = output_open(sample->stats_file, -1, NULL, async_off);
+    if (out == NULL) {
+        free(stats);
+        return 1;
+    }
+    output_write(out, stats, stats_len);
+    int ret_val = output_close(out);  // only written out here, so stats is freed after
+    free(stats);
+    return ret_val;
+}
+
+
+static void init_sample(Sample* sample) {
+    // zero a sample's counts, once all criteria have been added
+    sample->read_pairs_checked = 0;
+    sample->read_pairs_removed = 0;
+    sample->read_pairs_remaining = 0;
+    sample->criteria_checked = calloc(ncriteria, sizeof (long long));
+    sample->criteria_failed = calloc(ncriteria, sizeof (long long));
+    memset(&sample->bloom_counts, 0, sizeof (BloomCounts));
+    sample->exit_status = 0;
+}
+
+
+static Sample* read_manifest(char* path, int* nsamples) {
+    /*
+     Read the samples of a --manifest file, one per line, each given as the tab-separated paths i1, i2, o1, o2,
+     f1 and f2, optionally followed by a stats file. Blank lines and lines starting with '#' are skipped.
+
+     :output: the samples, or NULL if the manifest can't be read, has no samples, or has a line without 6 or 7
+        fields
+     */
+    gzFile f = open_list(path);
+    if (f == NULL) {
+        fprintf(stderr, "Could not open manifest %s\n", path);
+        return NULL;
+    }
+    Sample* samples = NULL;
+    *nsamples = 0;
+    size_t line_size = block_size;
+    char* line = malloc(sizeof (char) * line_size);
+    size_t len;
+    int line_number = 0;
+    bool valid = true;
+    
+    while (valid && (len = readln(f, &line, &line_size)) > 0) {
+        line_number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        
+        // split a copy of the line in place, which the sample's paths point into for the rest of the run
+        char* fields_line = malloc(sizeof (char) * (len + 1));
+        strcpy(fields_line, line);
+        char* fields[7] = {NULL};
+        int nfields = 0;
+        char* field = fields_line;
+        bool empty_field = false;
+        while (field != NULL) {
+            char* tab = strchr(field, '\t');
+            if (tab != NULL) {
+                *tab = '\0';
+            }
+            empty_field |= *field == '\0';
+            if (nfields < 7) {
+                fields[nfields] = field;
+            }
+            nfields++;
+            field = tab == NULL ? NULL : tab + 1;
+        }
+        if (nfields < 6 || nfields > 7 || empty_field) {
+            fprintf(
+                stderr, "Line %i of manifest %s should be the tab-separated paths i1, i2, o1, o2, f1, f2 and, "
+                "optionally, a stats file\n", line_number, path
+            );
+            free(fields_line);
+            valid = false;
+            continue;
+        }
+        
+        samples = realloc(samples, sizeof (Sample) * (*nsamples + 1));
+        Sample* sample = &samples[(*nsamples)++];
+        sample->r1i_path = fields[0];
+        sample->r2i_path = fields[1];
+        sample->r1o_path = fields[2];
+        sample->r2o_path = fields[3];
+        sample->r1f_path = fields[4];
+        sample->r2f_path = fields[5];
+        sample->stats_file = fields[6];
+    }
+    free(line);
+    gzclose(f);
+    if (valid && *nsamples == 0) {
+        fprintf(stderr, "No samples in manifest %s\n", path);
+        valid = false;
+    }
+    if (!valid) {
+        free(samples);  // the samples' paths are left, since the run is about to fail
+        return NULL;
+    }
+    return samples;
+}
+
+
+static void filter_sample(Task* task) {
+    Sample* sample = (Sample*) task;
+    sample->exit_status = filter_fastqs(sample);
+}
+
+
+static int filter_samples(Sample* samples, int nsamples) {
+    /*
+     Filter every sample of a manifest, each as a task on the pool. The blocks of each sample's compressed inputs
+     and outputs are tasks on the same pool, which a worker waiting on one of them runs, or steals from other
+     workers, in the meantime, and workers with nothing else to do start on the next sample. The samples share
+     the criteria, along with any tiles or read IDs to remove.
+
+     :output: 1 if any sample failed, otherwise 0
+     */
+    int i;
+    for (i=0; i<nsamples; i++) {
+        task_init(&samples[i].task, filter_sample);
+        pool_submit(pool, &samples[i].task);
+    }
+    int exit_status = 0;
+    for (i=0; i<nsamples; i++) {
+        task_wait(&samples[i].task);
+        task_destroy(&samples[i].task);
+        if (samples[i].exit_status != 0) {
+            exit_status = 1;
+        }
+    }
+    return exit_status;
 }
 
 
@@ -457,12 +1495,32 @@ int main(int argc, char* argv[]) {
         {"o2", required_argument, 0, 14},
         {"f1", required_argument, 0, 15},
         {"f2", required_argument, 0, 16},
+        {"threads", required_argument, 0, 17},
+        {"compress_output", optional_argument, 0, 18},
+        {"criteria_stats", no_argument, 0, 19},
+        {"adaptive_criteria", no_argument, 0, 20},
+        {"bloom_filter", optional_argument, 0, 21},
+        {"remove_reads_sorted", required_argument, 0, 22},
+        {"remove_y_flagged", no_argument, 0, 23},
+        {"async_output", optional_argument, 0, 25},
+        {"interleaved_in", no_argument, 0, 26},
+        {"interleaved_out", no_argument, 0, 27},
+        {"single_end", no_argument, 0, 28},
+        {"manifest", required_argument, 0, 29},
         {0, 0, 0, 0}
     };
     int opt_idx = 0;
     char* stats_file = NULL;
-    criteria = malloc(sizeof (bool(*)(FastqReadPair)) * (ncriteria + 1));
-    criteria[ncriteria] = std_check_read;
+    char* end;  // where a numeric argument stopped being parsed
+    
+    if (argc > 1 && strcmp(argv[1], "index_reads") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, USAGE);
+            return 1;
+        }
+        return index_reads(argv[2], argv[3]);
+    }
+    add_criterion("threshold", std_check_reads, 1, false);
     
     while ((arg = getopt_long(argc, argv, "", args, &opt_idx)) != -1) {
         switch(arg) {
@@ -478,7 +1536,7 @@ int main(int argc, char* argv[]) {
                 quiet = true;
                 break;
             case 4:
-                read_func = readln_unsafe;
+                _log("--unsafe is no longer needed, and will be ignored\n");
                 break;
             case 5:
                 stats_file = malloc(sizeof (char) * (strlen(optarg) + 1));
@@ -491,25 +1549,35 @@ int main(int argc, char* argv[]) {
                 remove_tiles = malloc(sizeof (char) * (strlen(optarg) + 1));
                 strcpy(remove_tiles, optarg);
                 build_remove_tiles();
-                ncriteria++;
-                criteria = realloc(criteria, sizeof (bool(*)(FastqReadPair)) * (ncriteria + 1));
-                criteria[ncriteria] = tile_check_read;
+                add_criterion("remove_tiles", tile_check_reads, 2, false);
+                parse_r1_headers = true;
                 break;
             case 8:
                 remove_reads_path = malloc(sizeof (char) * (strlen(optarg) + 1));
                 strcpy(remove_reads_path, optarg);
                 build_remove_reads();
-                ncriteria++;
-                criteria = realloc(criteria, sizeof (bool(*)(FastqReadPair)) * (ncriteria + 1));
-                criteria[ncriteria] = id_check_read;
+                add_criterion("remove_reads", id_check_reads, 8, false);
+                parse_r1_headers = true;
+                break;
+            case 22:
+                remove_reads_sorted_path = malloc(sizeof (char) * (strlen(optarg) + 1));
+                strcpy(remove_reads_sorted_path, optarg);
+                open_remove_reads_sorted();
+                add_criterion("remove_reads_sorted", sorted_check_reads, 1, true);
+                parse_r1_headers = true;
+                break;
+            case 23:
+                add_criterion("remove_y_flagged", filter_flag_check_reads, 1, false);
+                parse_r1_headers = true;
+                parse_r2_headers = true;
                 break;
             case 9:
                 trim_r1 = atoi(optarg);
-                include_func_r1 = trim_include_r1;
+                write_func_r1 = write_reads_trimmed;
                 break;
             case 10:
                 trim_r2 = atoi(optarg);
-                include_func_r2 = trim_include_r2;
+                write_func_r2 = write_reads_trimmed;
                 break;
             case 11:
                 r1i_path = malloc(sizeof (char) * (strlen(optarg) + 1));
@@ -535,56 +1603,287 @@ int main(int argc, char* argv[]) {
                 r2f_path = malloc(sizeof (char) * (strlen(optarg) + 1));
                 strcpy(r2f_path, optarg);
                 break;
+            case 17:
+                nthreads = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || nthreads < 1 || nthreads > 1024) {
+                    fprintf(stderr, "Invalid number of threads: %s - must be from 1 to 1024\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 18:
+                // a gzip level is a single digit, so anything else, e.g. -5 or 10, is invalid
+                if (optarg != NULL && (strlen(optarg) != 1 || optarg[0] < '0' || optarg[0] > '9')) {
+                    fprintf(stderr, "Invalid compression level: %s\n", optarg);
+                    exit(1);
+                }
+                compress_level = optarg ? atoi(optarg) : 6;
+                break;
+            case 19:
+                criteria_stats = true;
+                break;
+            case 20:
+                adaptive_criteria = true;
+                break;
+            case 21:
+                if (optarg != NULL) {
+                    bloom_fpr = strtod(optarg, &end);
+                    if (end == optarg || *end != '\0' || !(bloom_fpr > 0 && bloom_fpr < 1)) {
+                        fprintf(
+                            stderr, "Invalid Bloom filter false positive rate: %s - must be between 0 and 1\n", optarg
+                        );
+                        exit(1);
+                    }
+                } else {
+                    bloom_fpr = 0.01;
+                }
+                break;
+            case 25:
+                if (optarg == NULL || strcmp(optarg, "io_uring") == 0) {
+                    async_mode = async_uring;
+                } else if (strcmp(optarg, "threads") == 0) {
+                    async_mode = async_threads;
+                } else {
+                    fprintf(stderr, "Invalid async output backend: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 26:
+                interleaved_in = true;
+                break;
+            case 27:
+                interleaved_out = true;
+                break;
+            case 28:
+                single_end = true;
+                break;
+            case 29:
+                manifest_path = malloc(sizeof (char) * (strlen(optarg) + 1));
+                strcpy(manifest_path, optarg);
+                break;
             default:
                 exit(1);
         }
     }
-    
-    if (r1i_path == NULL || r2i_path == NULL || threshold == -1) {
-        printf("Missing required arguments: r1i, r2i, threshold\n");
+    if (optind < argc) {
+        // most likely the value of an option with an optional argument, which getopt only takes after an '='
+        fprintf(
+            stderr, "Unexpected argument: %s - optional values must be given with '=', e.g. --compress_output=1\n",
+            argv[optind]
+        );
         exit(1);
     }
     
-    if (r1o_path == NULL) {
-        _log("No o1 argument given - deriving from i1\n");
-        r1o_path = build_output_path(r1i_path, "_filtered.fastq");
+    if (manifest_path != NULL && (
+            r1i_path || r2i_path || r1o_path || r2o_path || r1f_path || r2f_path || stats_file || single_end
+            || interleaved_in || interleaved_out || remove_reads_sorted_path || adaptive_criteria)) {
+        fprintf(
+            stderr, "--manifest can't be used with --i1, --i2, --o1, --o2, --f1, --f2, --stats_file, --single_end, "
+            "--interleaved_in, --interleaved_out, --remove_reads_sorted or --adaptive_criteria\n"
+        );
+        exit(1);
+    }
+    if ((manifest_path == NULL && (r1i_path == NULL || (r2i_path == NULL && !interleaved_in && !single_end)))
+            || threshold == -1) {
+        fprintf(stderr, "Missing required arguments: r1i, r2i, threshold\n");
+        exit(1);
     }
-    if (r2o_path == NULL) {
-        _log("No o2 argument given - deriving from i2\n");
-        r2o_path = build_output_path(r2i_path, "_filtered.fastq");
+    if (single_end && (interleaved_in || interleaved_out)) {
+        fprintf(stderr, "--single_end can't be used with --interleaved_in or --interleaved_out\n");
+        exit(1);
     }
-    
-    if (r1f_path == NULL) {
-        _log("No f1 argument given - deriving from i1\n");
-        r1f_path = build_output_path(r1i_path, "_filtered_reads.fastq");
+    if (interleaved_in && r2i_path != NULL) {
+        fprintf(stderr, "--interleaved_in can't be used with --i2, as R2 is read from --i1\n");
+        exit(1);
+    }
+    if (interleaved_out && (r2o_path != NULL || r2f_path != NULL)) {
+        fprintf(stderr, "--interleaved_out can't be used with --o2 or --f2, as R2 is written to --o1 and --f1\n");
+        exit(1);
+    }
+    if (interleaved_in) {
+        r2i_path = r1i_path;
     }
-    if (r2f_path == NULL) {
-        _log("No f2 argument given - deriving from i2\n");
-        r2f_path = build_output_path(r2i_path, "_filtered_reads.fastq");
+    if (single_end && (r2i_path || r2o_path || r2f_path || trim_r2)) {
+        fprintf(stderr, "--single_end can't be used with --i2, --o2, --f2 or --trim_r2\n");
+        exit(1);
+    }
+    
+    if (remove_reads_path != NULL && bloom_fpr > 0) {
+        idset_add_bloom(reads_to_remove, bloom_fpr);
     }
+    
+    Sample* samples;
+    int nsamples = 1;
+    if (manifest_path != NULL) {
+        samples = read_manifest(manifest_path, &nsamples);
+        if (samples == NULL) {
+            exit(1);
+        }
+        _log("Manifest: %s (%i samples)\n", manifest_path, nsamples);
+    } else {
+        char* output_ext = compress_level >= 0 ? "_filtered.fastq.gz" : "_filtered.fastq";
+        char* filtered_reads_ext = compress_level >= 0 ? "_filtered_reads.fastq.gz" : "_filtered_reads.fastq";
+        
+        // R1 and R2 outputs derived from the same interleaved input need telling apart
+        char* r1_name = interleaved_in && !interleaved_out ? "_R1" : "";
+        char* r2_name = interleaved_in && !interleaved_out ? "_R2" : "";
+        
+        if (r1o_path == NULL) {
+            _log("No o1 argument given - deriving from i1\n");
+            r1o_path = build_output_path(r1i_path, r1_name, output_ext);
+        }
+        if (r1f_path == NULL) {
+            _log("No f1 argument given - deriving from i1\n");
+            r1f_path = build_output_path(r1i_path, r1_name, filtered_reads_ext);
+        }
+        if (interleaved_out) {
+            r2o_path = r1o_path;
+            r2f_path = r1f_path;
+        }
+        
+        if (r2o_path == NULL && !single_end) {
+            _log("No o2 argument given - deriving from i2\n");
+            r2o_path = build_output_path(r2i_path, r2_name, output_ext);
+        }
+        if (r2f_path == NULL && !single_end) {
+            _log("No f2 argument given - deriving from i2\n");
+            r2f_path = build_output_path(r2i_path, r2_name, filtered_reads_ext);
+        }
+        if (r1o_path == NULL || r1f_path == NULL || (!single_end && (r2o_path == NULL || r2f_path == NULL))) {
+            fprintf(
+                stderr, "Output paths can only be derived from inputs named *.fastq or *.fastq.gz - use --o1/--o2/--f1/--f2\n"
+            );
+            exit(1);
+        }
 
-    _log("R1 input: %s\n", r1i_path);
-    _log("R2 input: %s\n", r2i_path);
-    _log("R1 output: %s\n", r1o_path);
-    _log("R2 output: %s\n", r2o_path);
-    _log("R1 filtered reads: %s\n", r1f_path);
-    _log("R2 filtered reads: %s\n", r2f_path);
+        if (single_end) {
+            _log("Single-end input: %s\n", r1i_path);
+        } else if (interleaved_in) {
+            _log("Interleaved input: %s\n", r1i_path);
+        } else {
+            _log("R1 input: %s\n", r1i_path);
+            _log("R2 input: %s\n", r2i_path);
+        }
+        if (single_end) {
+            _log("Output: %s\n", r1o_path);
+            _log("Filtered reads: %s\n", r1f_path);
+        } else if (interleaved_out) {
+            _log("Interleaved output: %s\n", r1o_path);
+            _log("Interleaved filtered reads: %s\n", r1f_path);
+        } else {
+            _log("R1 output: %s\n", r1o_path);
+            _log("R2 output: %s\n", r2o_path);
+            _log("R1 filtered reads: %s\n", r1f_path);
+            _log("R2 filtered reads: %s\n", r2f_path);
+        }
+        
+        samples = malloc(sizeof (Sample));
+        samples->r1i_path = r1i_path;
+        samples->r2i_path = r2i_path;
+        samples->r1o_path = r1o_path;
+        samples->r2o_path = r2o_path;
+        samples->r1f_path = r1f_path;
+        samples->r2f_path = r2f_path;
+        samples->stats_file = stats_file;
+    }
+    int i;
+    for (i=0; i<nsamples; i++) {
+        init_sample(&samples[i]);
+    }
     _log("Filter threshold: %i\n", threshold);
     if (trim_r1) {_log("Trimming R1 to %i\n", trim_r1);}
     if (trim_r2) {_log("Trimming R2 to %i\n", trim_r2);}
     if (remove_tiles) {_log("Removing tiles: %s\n", remove_tiles);}
-    if (remove_reads_path) {_log("Removing reads in: %s\n", remove_reads_path);}
-    _log("Matching %i criteria\n", ncriteria + 1);
+    if (remove_reads_path) {
+        _log(
+            "Removing reads in: %s (%llu read IDs, %llu of them packed, %zu bytes)\n", remove_reads_path,
+            (unsigned long long) (reads_to_remove->nkeys + reads_to_remove->npacked),
+            (unsigned long long) reads_to_remove->npacked, idset_memory(reads_to_remove)
+        );
+    }
+    if (remove_reads_path && bloom_fpr > 0) {
+        _log(
+            "Added Bloom filter for a false positive rate of %g (%llu bytes)\n", bloom_fpr,
+            (unsigned long long) (reads_to_remove->bloom->nblocks * 64)
+        );
+    }
+    if (remove_reads_sorted_path) {_log("Removing reads in order from: %s\n", remove_reads_sorted_path);}
+    if (compress_level >= 0) {_log("Compressing output at level %i\n", compress_level);}
+    if (async_mode == async_uring && !writer_uring_available()) {
+        _log("io_uring is not available - writing output asynchronously on threads instead\n");
+        async_mode = async_threads;
+    }
+    if (async_mode == async_uring) {_log("Writing output asynchronously through io_uring\n");}
+    if (async_mode == async_threads) {_log("Writing output asynchronously on threads\n");}
+    _log("Matching %i criteria\n", ncriteria);
+    choose_check_func();
+    if (check_func != check_read_pairs) {_log("Using a specialised check loop\n");}
+    _log("Using %s newline scanner\n", fastq_scanner_name());
     
-    int exit_status = filter_fastqs();
+    int exit_status;
+    if (manifest_path != NULL) {
+        _log("Filtering %i samples on a pool of %i threads\n", nsamples, nthreads);
+        pool = pool_new(nthreads);
+        exit_status = filter_samples(samples, nsamples);
+        pool_free(pool);
+    } else if (nthreads > 1) {
+        _log("Running threaded pipeline\n");
+        pool = pool_new(nthreads);
+        exit_status = filter_fastqs_threaded(samples);
+        pool_free(pool);
+    } else {
+        exit_status = filter_fastqs(samples);
+    }
+    free_batches();
+    writer_shutdown();
+    if (remove_reads_sorted_path && close_remove_reads_sorted() != 0) {
+        remove_outputs(samples);  // reads after an out-of-order ID were kept that should have been removed
+        exit_status = 1;
+    }
+    if (reads_to_remove != NULL && reads_to_remove->corrupt) {
+        _log("%s is a corrupt index - its slots point outside it, so run index_reads again\n", remove_reads_path);
+        for (i=0; i<nsamples; i++) {
+            remove_outputs(&samples[i]);  // reads may have been looked up wrongly
+        }
+        exit_status = 1;
+    }
     
-    _log("Checked %i read pairs, %i removed, %i remaining. Exit status %i\n",
-         read_pairs_checked, read_pairs_removed, read_pairs_remaining, exit_status);
+    for (i=0; i<nsamples; i++) {
+        Sample* sample = &samples[i];
+        if (manifest_path != NULL) {
+            _log("Sample %i, %s: checked %i read pairs, %i removed, %i remaining. Exit status %i\n", i + 1,
+                 sample->r1i_path, sample->read_pairs_checked, sample->read_pairs_removed,
+                 sample->read_pairs_remaining, sample->exit_status);
+        } else {
+            _log("Checked %i %s, %i removed, %i remaining. Exit status %i\n", sample->read_pairs_checked,
+                 single_end ? "reads" : "read pairs", sample->read_pairs_removed, sample->read_pairs_remaining,
+                 exit_status);
+        }
+    }
+    if (manifest_path != NULL) {
+        _log("Filtered %i samples. Exit status %i\n", nsamples, exit_status);
+    }
+    _log("Peak memory used by read batches: %zu bytes\n", batch_memory_peak());
+    if (adaptive_criteria) {
+        for (i=0; i<ncriteria; i++) {
+            _log("Criterion %i: %s\n", i + 1, criteria[criteria_order[i]].name);
+        }
+    }
 
-    if (stats_file != NULL) {
-        _log("Writing stats file %s\n", stats_file);
-        output_stats(stats_file);
+    for (i=0; i<nsamples; i++) {
+        if (samples[i].stats_file != NULL) {
+            _log("Writing stats file %s\n", samples[i].stats_file);
+            if (output_stats(&samples[i]) != 0) {
+                _log("Could not write stats file %s\n", samples[i].stats_file);
+                exit_status = 1;
+            }
+        }
+        free(samples[i].criteria_checked);
+        free(samples[i].criteria_failed);
+        if (manifest_path != NULL) {
+            free(samples[i].r1i_path);  // the start of the sample's line of the manifest, which its paths point into
+        }
     }
+    free(samples);
     
     return exit_status;
 }
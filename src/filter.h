@@ -13,18 +13,32 @@
 #define USAGE "\
 Fastq-Filterer\n\
 Usage: fastq_filterer --i1 <r1.fastq> --i2 <r2.fastq> --threshold <filter_threshold>\n\
-Fastq or fastq.gz files can be read in, but output will always be uncompressed.\n\
+       fastq_filterer --manifest <samples.tsv> --threshold <filter_threshold>\n\
+       fastq_filterer index_reads <rm_reads.txt> <rm_reads.idx>\n\
+Fastq or fastq.gz files can be read in, and output is uncompressed unless --compress_output is used.\n\
+Any input or output can be - for stdin or stdout, or a named pipe. Logging goes to stderr.\n\
 Options:\n\
 --o1 <r1_filtered.fastq> - output file name for r1 (defaults to <input_path>_filtered.fastq)\n\
 --o2 <r2_filtered.fastq> - as above for r2\n\
 --f1 <r1_filtered_reads.fastq> - filtered reads file name for r1 (defaults to <input_path_filtered_reads.fastq)\n\
 --f2 <r2_filtered_reads.fastq> - as above for r2\n\
+--interleaved_in - read R1 and R2 from alternate records of the --i1 fastq, with no --i2\n\
+--interleaved_out - write each pair's R1 then R2 to the --o1 and --f1 fastqs, with no --o2 or --f2\n\
+--single_end - filter single-end reads from --i1 alone, with no --i2, --o2 or --f2\n\
 --stats_file <stats_file> - write a file summarising the read pairs checked and removed\n\
---unsafe - use a simpler read function which is faster, but will chop lines over 4096 characters\n\
+--manifest <samples.tsv> - filter each line's tab-separated i1 i2 o1 o2 f1 f2 [stats_file] on one pool of --threads\n\
 --remove_tiles <tile1,tile2,tile3...> - comma-separated list of tile ids to remove regardless of length\n\
---remove_reads <rm_reads.txt> - text file containing read names to filter out\n\
+--remove_reads <rm_reads.txt> - text file containing read names to filter out, or an index of one from index_reads\n\
+--remove_reads_sorted <rm_reads.txt> - as --remove_reads, but streamed, for a list in the same order as the input\n\
+--remove_y_flagged - remove read pairs where either read's header has a filter flag of Y\n\
+--bloom_filter[=<fpr>] - check --remove_reads against a Bloom filter with this false positive rate first (default 0.01)\n\
 --trim_r1 <max_len> - trim all reads in the r1 output file to a maximum length\n\
 --trim_r2 <max_len> - as above for r2\n\
+--threads <n> - run reading, filtering and writing on separate threads if n is greater than 1\n\
+--compress_output[=<level>] - write BGZF-compressed output at a gzip level from 0 to 9 (default 6), given after '='\n\
+--async_output[=<io_uring|threads>] - write output in the background, through io_uring if available (default)\n\
+--criteria_stats - check every criterion on each read pair and report how many pairs each one failed\n\
+--adaptive_criteria - reorder criteria as the run goes on, so that cheap, frequently-failing ones go first\n\
 \n"
 #endif
 
@@ -0,0 +1,579 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "idset.h"
+
+#define initial_slots 1024
+#define offset_bits 40  // arenas of up to 1TB
+#define offset_mask (((uint64_t) 1 << offset_bits) - 1)
+#define long_key 0xff
+
+// bits for each field of a packed Illumina coordinate, which must add up to 64
+#define lane_bits 6
+#define tile_bits 19
+#define x_bits 19
+#define y_bits 20
+
+#define bloom_block_words 8  // 512 bits, i.e. one cache line
+
+// an index file is this header, then the slots, the packed slots, the arena and the prefix, in native byte order
+static const char index_magic[8] = {'F', 'Q', 'F', 'I', 'D', 'X', '0', '1'};
+
+typedef struct {
+    char magic[8];
+    uint64_t nslots, nkeys, arena_len, prefix_len, npacked_slots, npacked;
+} IndexHeader;
+
+
+static uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+static uint64_t hash_key(char* key, size_t len) {
+    /*
+     Hash a key 8 bytes at a time. The low bits of the hash pick a key's first slot, and the top bits are kept
+     in the slot as a tag, so most slots holding other keys can be skipped without looking at the arena.
+     */
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, key, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        key += 8;
+        len -= 8;
+    }
+    word = 0;
+    memcpy(&word, key, len);
+    return mix(h ^ word);
+}
+
+
+static char* get_key(IdSet* set, uint64_t slot, size_t* len) {
+    /*
+     :output: the key a slot points to, or NULL if it isn't all inside the arena, which can only happen for a
+              corrupt index
+     */
+    uint64_t offset = (slot & offset_mask) - 1;  // and an offset of 0 wraps around to fail the check
+    if (offset >= set->arena_len) {
+        return NULL;
+    }
+    unsigned char* p = (unsigned char*) set->arena + offset;
+    size_t header_len = 1;
+    if (p[0] != long_key) {
+        *len = p[0];
+    } else {
+        if (set->arena_len - offset < 5) {
+            return NULL;
+        }
+        uint32_t long_len;
+        memcpy(&long_len, p + 1, 4);
+        *len = long_len;
+        header_len = 5;
+    }
+    if (set->arena_len - offset - header_len < *len) {
+        return NULL;
+    }
+    return (char*) p + header_len;
+}
+
+
+static void mark_corrupt(IdSet* set) {
+    __atomic_store_n(&set->corrupt, true, __ATOMIC_RELAXED);  // may be looked up in from several threads at once
+}
+
+
+static uint64_t* find_slot(IdSet* set, char* key, size_t len, uint64_t hash) {
+    /*
+     Linear probe from the key's first slot, returning the slot holding the key, or the empty slot where it
+     would go. A set built in memory always has an empty slot, but a corrupt index may not, so this gives up
+     after probing every slot and returns NULL.
+     */
+    uint64_t tag = hash >> offset_bits << offset_bits;
+    uint64_t i = hash & (set->nslots - 1);
+    uint64_t nprobes;
+    for (nprobes=0; nprobes<set->nslots; nprobes++) {
+        uint64_t slot = set->slots[i];
+        if (slot == 0) {
+            return &set->slots[i];
+        }
+        if ((slot & ~offset_mask) == tag) {
+            size_t slot_len;
+            char* slot_key = get_key(set, slot, &slot_len);
+            if (slot_key == NULL) {
+                mark_corrupt(set);
+            } else if (slot_len == len && memcmp(slot_key, key, len) == 0) {
+                return &set->slots[i];
+            }
+        }
+        i = (i + 1) & (set->nslots - 1);
+    }
+    mark_corrupt(set);
+    return NULL;
+}
+
+
+static void grow(IdSet* set) {
+    /*
+     Double the number of slots, and re-insert every key by walking the arena in order rather than the old
+     slots, since the arena holds each key exactly once and can be read sequentially.
+     */
+    free(set->slots);
+    set->nslots *= 2;
+    set->slots = calloc(set->nslots, sizeof (uint64_t));
+
+    uint64_t pos = 0;
+    while (pos < set->arena_len) {
+        uint64_t slot = pos + 1;
+        size_t len;
+        char* key = get_key(set, slot, &len);
+        uint64_t hash = hash_key(key, len);
+        *find_slot(set, key, len, hash) = (hash >> offset_bits << offset_bits) | slot;
+        pos = key + len - set->arena;
+    }
+}
+
+
+static bool parse_field(char** p, char* end, char delimiter, int bits, uint64_t* value) {
+    /*
+     Parse a number written without leading zeros, ending at the delimiter (which is skipped) or at end if the
+     delimiter is '\0', and check that it fits in the given number of bits.
+     */
+    char* start = *p;
+    uint64_t x = 0;
+    while (*p < end && **p != delimiter) {
+        if (**p < '0' || **p > '9' || *p - start >= 7) {
+            return false;
+        }
+        x = x * 10 + **p - '0';
+        (*p)++;
+    }
+    if (*p == start || (*start == '0' && *p - start > 1) || x >> bits != 0) {
+        return false;
+    }
+    if (delimiter != '\0') {
+        if (*p == end) {
+            return false;
+        }
+        (*p)++;
+    }
+    *value = x;
+    return true;
+}
+
+
+static size_t find_prefix(char* key, size_t len) {
+    // length of everything up to and including the third colon, i.e. up to the lane, or 0 if there isn't one
+    size_t i;
+    int ncolons = 0;
+    for (i=0; i<len; i++) {
+        if (key[i] == ':' && ++ncolons == 3) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+
+static uint64_t pack_coords(char* p, char* end) {
+    /*
+     Pack 'lane:tile:x:y' into a 64-bit integer, or return 0 if it isn't in that form or doesn't fit. Lane 0 is
+     not packed, so that a packed key is never 0.
+     */
+    uint64_t lane, tile, x, y;
+    if (!parse_field(&p, end, ':', lane_bits, &lane) || !parse_field(&p, end, ':', tile_bits, &tile)
+            || !parse_field(&p, end, ':', x_bits, &x) || !parse_field(&p, end, '\0', y_bits, &y) || lane == 0) {
+        return 0;
+    }
+    return lane << (tile_bits + x_bits + y_bits) | tile << (x_bits + y_bits) | x << y_bits | y;
+}
+
+
+static uint64_t pack_key(IdSet* set, char* key, size_t len) {
+    if (set->prefix == NULL || len < set->prefix_len || memcmp(key, set->prefix, set->prefix_len) != 0
+            || find_prefix(key, len) != set->prefix_len) {
+        return 0;
+    }
+    return pack_coords(key + set->prefix_len, key + len);
+}
+
+
+static uint64_t* find_packed_slot(IdSet* set, uint64_t packed) {
+    // as find_slot, for a packed key
+    uint64_t i = mix(packed) & (set->npacked_slots - 1);
+    uint64_t nprobes;
+    for (nprobes=0; nprobes<set->npacked_slots; nprobes++) {
+        if (set->packed_slots[i] == 0 || set->packed_slots[i] == packed) {
+            return &set->packed_slots[i];
+        }
+        i = (i + 1) & (set->npacked_slots - 1);
+    }
+    mark_corrupt(set);
+    return NULL;
+}
+
+
+static void add_packed(IdSet* set, uint64_t packed) {
+    uint64_t* slot = find_packed_slot(set, packed);
+    if (*slot != 0) {
+        return;
+    }
+    *slot = packed;
+    set->npacked++;
+
+    if (set->npacked * 4 > set->npacked_slots * 3) {
+        uint64_t* old_slots = set->packed_slots;
+        uint64_t old_nslots = set->npacked_slots;
+        set->npacked_slots *= 2;
+        set->packed_slots = calloc(set->npacked_slots, sizeof (uint64_t));
+        uint64_t i;
+        for (i=0; i<old_nslots; i++) {
+            if (old_slots[i] != 0) {
+                *find_packed_slot(set, old_slots[i]) = old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+}
+
+
+static uint64_t* bloom_block(BloomFilter* bloom, uint64_t hash) {
+    return bloom->blocks + ((mix(hash ^ 0x5bd1e9955bd1e995ULL) >> 32) & (bloom->nblocks - 1)) * bloom_block_words;
+}
+
+
+static bool bloom_bits(BloomFilter* bloom, uint64_t hash, bool set) {
+    /*
+     Set or test a key's bits in its block, taking 9 bits of the hash at a time for each bit's position and
+     re-mixing the hash whenever it runs out.
+
+     :output: whether all of the key's bits were already set
+     */
+    uint64_t* block = bloom_block(bloom, hash);
+    uint64_t bits = mix(hash);
+    int navailable = 7;
+    int i;
+    for (i=0; i<bloom->nbits; i++) {
+        if (navailable == 0) {
+            bits = mix(bits);
+            navailable = 7;
+        }
+        uint64_t mask = (uint64_t) 1 << (bits & 63);
+        uint64_t* word = &block[(bits >> 6) & 7];
+        if (set) {
+            *word |= mask;
+        } else if (!(*word & mask)) {
+            return false;
+        }
+        bits >>= 9;
+        navailable--;
+    }
+    return true;
+}
+
+
+IdSet* idset_new() {
+    IdSet* set = malloc(sizeof (IdSet));
+    set->nslots = initial_slots;
+    set->nkeys = 0;
+    set->slots = calloc(set->nslots, sizeof (uint64_t));
+    set->arena_size = initial_slots * 32;
+    set->arena_len = 0;
+    set->arena = malloc(set->arena_size);
+    set->prefix = NULL;
+    set->prefix_len = 0;
+    set->npacked_slots = initial_slots;
+    set->npacked = 0;
+    set->packed_slots = calloc(set->npacked_slots, sizeof (uint64_t));
+    set->map = NULL;
+    set->map_len = 0;
+    set->bloom = NULL;
+    set->corrupt = false;
+    return set;
+}
+
+
+void idset_add(IdSet* set, char* key, size_t len) {
+    if (set->prefix == NULL) {  // use the first ID in Illumina format to set the prefix
+        size_t prefix_len = find_prefix(key, len);
+        if (prefix_len > 0 && pack_coords(key + prefix_len, key + len) != 0) {
+            set->prefix = malloc(prefix_len);
+            memcpy(set->prefix, key, prefix_len);
+            set->prefix_len = prefix_len;
+        }
+    }
+    uint64_t packed = pack_key(set, key, len);
+    if (packed != 0) {
+        add_packed(set, packed);
+        return;
+    }
+
+    uint64_t hash = hash_key(key, len);
+    uint64_t* slot = find_slot(set, key, len, hash);
+    if (*slot != 0) {  // already in the set
+        return;
+    }
+
+    size_t header_len = len < long_key ? 1 : 5;
+    while (set->arena_len + header_len + len > set->arena_size) {
+        set->arena_size *= 2;
+        set->arena = realloc(set->arena, set->arena_size);
+    }
+    unsigned char* p = (unsigned char*) set->arena + set->arena_len;
+    if (len < long_key) {
+        p[0] = len;
+    } else {
+        uint32_t long_len = len;
+        p[0] = long_key;
+        memcpy(p + 1, &long_len, 4);
+    }
+    memcpy(p + header_len, key, len);
+    *slot = (hash >> offset_bits << offset_bits) | (set->arena_len + 1);
+    set->arena_len += header_len + len;
+    set->nkeys++;
+
+    if (set->nkeys * 4 > set->nslots * 3) {  // keep the load factor under 3/4, so probe runs stay short
+        grow(set);
+    }
+}
+
+
+bool idset_contains(IdSet* set, char* key, size_t len, BloomCounts* counts) {
+    /*
+     :input BloomCounts* counts: where to count what the set's Bloom filter did with this key, if not NULL. These
+     are kept by the caller rather than the set, so that threads sharing a set can each keep their own.
+     */
+    uint64_t packed = pack_key(set, key, len);
+    uint64_t hash = packed != 0 ? mix(packed) : hash_key(key, len);
+    if (set->bloom != NULL) {
+        if (counts != NULL) {
+            counts->checked++;
+        }
+        if (!bloom_bits(set->bloom, hash, false)) {
+            if (counts != NULL) {
+                counts->rejected++;
+            }
+            return false;
+        }
+    }
+
+    uint64_t* slot = NULL;
+    if (packed != 0) {
+        slot = find_packed_slot(set, packed);
+    } else if (set->nkeys > 0) {
+        slot = find_slot(set, key, len, hash);
+    }
+    bool found = slot != NULL && *slot != 0;
+    if (set->bloom != NULL && !found && counts != NULL) {
+        counts->false_positives++;
+    }
+    return found;
+}
+
+
+void idset_prefetch(IdSet* set, char* key, size_t len) {
+    /*
+     Start loading the first slot that a lookup of this key would probe. Calling this a few keys ahead of
+     idset_contains lets the cache misses of several lookups overlap, rather than waiting on each in turn.
+     */
+    uint64_t packed = pack_key(set, key, len);
+    uint64_t hash = packed != 0 ? mix(packed) : hash_key(key, len);
+    if (set->bloom != NULL) {  // most lookups will stop at the Bloom filter
+        __builtin_prefetch(bloom_block(set->bloom, hash));
+    } else if (packed != 0) {
+        __builtin_prefetch(&set->packed_slots[hash & (set->npacked_slots - 1)]);
+    } else {
+        __builtin_prefetch(&set->slots[hash & (set->nslots - 1)]);
+    }
+}
+
+
+void idset_add_bloom(IdSet* set, double fpr) {
+    /*
+     Build a Bloom filter over every key in the set, sized for the given false positive rate. The optimal number
+     of bits per key for a plain Bloom filter is -ln(fpr) / ln(2)^2, and keeping each key's bits to one block makes
+     them clash more often, so a quarter more is used to make up for it.
+     */
+    BloomFilter* bloom = malloc(sizeof (BloomFilter));
+    uint64_t nkeys = set->nkeys + set->npacked;
+    double bits_per_key = -log(fpr) / (M_LN2 * M_LN2) * 1.25;
+    uint64_t nbits = (uint64_t) (bits_per_key * (nkeys + 1));
+    bloom->nblocks = 1;
+    while (bloom->nblocks * bloom_block_words * 64 < nbits) {
+        bloom->nblocks *= 2;
+    }
+    bloom->nbits = (int) (-log(fpr) / M_LN2 + 0.5);
+    if (bloom->nbits < 1) {
+        bloom->nbits = 1;
+    } else if (bloom->nbits > 16) {
+        bloom->nbits = 16;
+    }
+    bloom->blocks = calloc(bloom->nblocks * bloom_block_words, sizeof (uint64_t));
+
+    uint64_t i;
+    for (i=0; i<set->npacked_slots; i++) {
+        if (set->packed_slots[i] != 0) {
+            bloom_bits(bloom, mix(set->packed_slots[i]), true);
+        }
+    }
+    uint64_t pos = 0;
+    while (pos < set->arena_len) {
+        size_t len;
+        char* key = get_key(set, pos + 1, &len);
+        if (key == NULL) {  // the arena of a corrupt index runs off its end
+            mark_corrupt(set);
+            break;
+        }
+        bloom_bits(bloom, hash_key(key, len), true);
+        pos = key + len - set->arena;
+    }
+    set->bloom = bloom;
+}
+
+
+size_t idset_memory(IdSet* set) {
+    // bytes used by both tables' slots and the keys stored in the arena
+    size_t memory = (set->nslots + set->npacked_slots) * sizeof (uint64_t) + set->arena_len + set->prefix_len;
+    if (set->bloom != NULL) {
+        memory += set->bloom->nblocks * bloom_block_words * sizeof (uint64_t);
+    }
+    return memory;
+}
+
+
+int idset_write(IdSet* set, char* path) {
+    /*
+     Write a set out as an index file, which idset_map can load without rebuilding the tables.
+
+     :output: 0 if the index was written successfully, otherwise -1
+     */
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        return -1;
+    }
+    IndexHeader header;
+    memcpy(header.magic, index_magic, sizeof index_magic);
+    header.nslots = set->nslots;
+    header.nkeys = set->nkeys;
+    header.arena_len = set->arena_len;
+    header.prefix_len = set->prefix_len;
+    header.npacked_slots = set->npacked_slots;
+    header.npacked = set->npacked;
+
+    bool ok = fwrite(&header, sizeof header, 1, f) == 1
+        && fwrite(set->slots, sizeof (uint64_t), set->nslots, f) == set->nslots
+        && fwrite(set->packed_slots, sizeof (uint64_t), set->npacked_slots, f) == set->npacked_slots
+        && fwrite(set->arena, 1, set->arena_len, f) == set->arena_len
+        && (set->prefix_len == 0 || fwrite(set->prefix, 1, set->prefix_len, f) == set->prefix_len);
+    return (fclose(f) != 0 || !ok) ? -1 : 0;
+}
+
+
+static bool valid_table_size(uint64_t nslots, uint64_t nkeys, uint64_t max_nslots) {
+    // a power of 2, kept under 3/4 full as idset_add keeps it, so that probing always reaches an empty slot
+    return nslots > 0 && (nslots & (nslots - 1)) == 0 && nslots <= max_nslots && nkeys <= nslots / 4 * 3;
+}
+
+
+IdSet* idset_map(char* path, bool* is_index) {
+    /*
+     Memory-map an index file written by idset_write. Nothing is read up front beyond the header and the prefix,
+     so this takes the same time however big the index is, and lookups fault in the pages they need. Only the
+     header can be checked here, so lookups check each slot's offset into the arena as they go, and mark the set
+     as corrupt if any is out of bounds.
+
+     :output: the mapped set, or NULL if the file can't be opened or isn't a valid index. is_index is set if the
+              file starts like an index, so that a truncated or corrupt one isn't taken for something else.
+     */
+    *is_index = false;
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return NULL;  // not an index, and a pipe or FIFO must be left unread for it to be read as a list instead
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    IndexHeader header;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof header
+            || pread(fd, &header, sizeof header, 0) != sizeof header
+            || memcmp(header.magic, index_magic, sizeof index_magic) != 0) {
+        close(fd);
+        return NULL;
+    }
+    *is_index = true;
+    // each part is taken off what is left of the file in turn, so no size in a corrupt header can overflow
+    uint64_t remaining = st.st_size - sizeof header;
+    bool ok = valid_table_size(header.nslots, header.nkeys, remaining / sizeof (uint64_t));
+    if (ok) {
+        remaining -= header.nslots * sizeof (uint64_t);
+        ok = valid_table_size(header.npacked_slots, header.npacked, remaining / sizeof (uint64_t));
+    }
+    if (ok) {
+        remaining -= header.npacked_slots * sizeof (uint64_t);
+        ok = header.arena_len <= remaining && header.arena_len <= offset_mask
+            && header.prefix_len == remaining - header.arena_len
+            && (header.nkeys == 0) == (header.arena_len == 0) && (header.npacked == 0 || header.prefix_len > 0);
+    }
+    if (!ok) {
+        close(fd);
+        return NULL;
+    }
+
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);  // start reading it in, without waiting for it
+
+    IdSet* set = malloc(sizeof (IdSet));
+    set->nslots = header.nslots;
+    set->nkeys = header.nkeys;
+    set->slots = (uint64_t*) (map + sizeof header);
+    set->npacked_slots = header.npacked_slots;
+    set->npacked = header.npacked;
+    set->packed_slots = set->slots + set->nslots;
+    set->arena = (char*) (set->packed_slots + set->npacked_slots);
+    set->arena_len = header.arena_len;
+    set->arena_size = header.arena_len;
+    set->prefix_len = header.prefix_len;
+    set->prefix = header.prefix_len == 0 ? NULL : set->arena + set->arena_len;
+    set->map = map;
+    set->map_len = st.st_size;
+    set->bloom = NULL;
+    set->corrupt = false;
+    if (set->prefix != NULL && find_prefix(set->prefix, set->prefix_len) != set->prefix_len) {
+        idset_free(set);  // not a prefix that idset_add could have chosen
+        return NULL;
+    }
+    return set;
+}
+
+
+void idset_free(IdSet* set) {
+    if (set->bloom != NULL) {
+        free(set->bloom->blocks);
+        free(set->bloom);
+    }
+    if (set->map != NULL) {
+        munmap(set->map, set->map_len);
+        free(set);
+        return;
+    }
+    free(set->slots);
+    free(set->arena);
+    free(set->prefix);
+    free(set->packed_slots);
+    free(set);
+}
@@ -0,0 +1,66 @@
+#ifndef FastqFilterer_idset_h
+#define FastqFilterer_idset_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ A set of read IDs, held as a flat open-addressing hash table over an arena of packed keys. Each slot is a
+ single 64-bit word holding the top bits of its key's hash as a tag and the key's offset into the arena, so a
+ lookup usually touches one cache line of slots and, only if the tag matches, one of the arena. Keys are
+ stored as a length byte (or 0xff followed by a 4-byte length, for long keys) and then the key itself.
+
+ Slots and keys refer to each other only by offset, so a set can be written out to an index file with
+ idset_write, and later memory-mapped back in by idset_map without rebuilding anything. A mapped set is
+ read-only, and its pages are shared through the page cache with any other process mapping the same index.
+
+ Most read IDs are in Illumina's 'instrument:run:flowcell:lane:tile:x:y' form, and share everything up to the
+ lane. The first such ID added sets this prefix, and any ID with the same prefix whose lane, tile, x and y fit
+ in 64 bits between them is stored as a single integer in a second table instead, with no string at all. Only
+ numbers written without leading zeros are packed, so packing is lossless and IDs are matched exactly either way.
+ */
+/*
+ A blocked Bloom filter over the keys of an IdSet. All of a key's bits are in one 64-byte block, so checking a
+ key that isn't in the set touches a single cache line of a table much smaller than the set itself.
+ */
+typedef struct {
+    uint64_t* blocks;  // 8 words per block
+    uint64_t nblocks;  // a power of 2
+    int nbits;  // bits set per key
+} BloomFilter;
+
+
+typedef struct {  // what a set's Bloom filter made of the keys looked up in it
+    uint64_t checked, rejected, false_positives;
+} BloomCounts;
+
+
+typedef struct {
+    uint64_t* slots;  // 0 for an empty slot
+    uint64_t nslots, nkeys;  // nslots is a power of 2, and nkeys doesn't include packed keys
+    char* arena;
+    uint64_t arena_len, arena_size;
+    char* prefix;  // NULL until a packable ID has been added
+    size_t prefix_len;
+    uint64_t* packed_slots;  // packed keys, which are never 0
+    uint64_t npacked_slots, npacked;
+    void* map;  // the whole index file, for a mapped set
+    size_t map_len;
+    BloomFilter* bloom;  // checked before the tables, if not NULL
+    bool corrupt;  // set if a lookup in a mapped set found a slot that doesn't point inside the arena
+} IdSet;
+
+
+IdSet* idset_new();
+void idset_add(IdSet* set, char* key, size_t len);
+bool idset_contains(IdSet* set, char* key, size_t len, BloomCounts* counts);
+void idset_prefetch(IdSet* set, char* key, size_t len);
+size_t idset_memory(IdSet* set);
+void idset_add_bloom(IdSet* set, double fpr);
+int idset_write(IdSet* set, char* path);
+IdSet* idset_map(char* path, bool* is_index);
+void idset_free(IdSet* set);
+
+#endif
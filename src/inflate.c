@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "inflate.h"
+
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#include <isa-l/crc.h>
+#endif
+
+
+static void* zlib_backend_new_state() {
+    z_stream* zs = calloc(1, sizeof (z_stream));
+    inflateInit2(zs, -15);
+    return zs;
+}
+
+
+static bool zlib_backend_inflate(void* state, unsigned char* in, size_t in_len, char* out, size_t out_size, size_t* out_len) {
+    z_stream* zs = state;
+    inflateReset(zs);
+    zs->next_in = in;
+    zs->avail_in = in_len;
+    zs->next_out = (unsigned char*) out;
+    zs->avail_out = out_size;
+    int ret = inflate(zs, Z_FINISH);
+    *out_len = zs->total_out;
+    return ret == Z_STREAM_END;
+}
+
+
+static unsigned long zlib_backend_crc32(unsigned long crc, char* buf, size_t len) {
+    return crc32(crc, (unsigned char*) buf, len);
+}
+
+
+static void zlib_backend_free_state(void* state) {
+    inflateEnd(state);
+    free(state);
+}
+
+
+static InflateBackend zlib_backend = {
+    "zlib", zlib_backend_new_state, zlib_backend_inflate, zlib_backend_crc32, zlib_backend_free_state
+};
+
+
+#ifdef HAVE_LIBDEFLATE
+static void* libdeflate_backend_new_state() {
+    return libdeflate_alloc_decompressor();
+}
+
+
+static bool libdeflate_backend_inflate(void* state, unsigned char* in, size_t in_len, char* out, size_t out_size, size_t* out_len) {
+    return libdeflate_deflate_decompress(state, in, in_len, out, out_size, out_len) == LIBDEFLATE_SUCCESS;
+}
+
+
+static unsigned long libdeflate_backend_crc32(unsigned long crc, char* buf, size_t len) {
+    return libdeflate_crc32(crc, buf, len);
+}
+
+
+static void libdeflate_backend_free_state(void* state) {
+    libdeflate_free_decompressor(state);
+}
+
+
+static InflateBackend libdeflate_backend = {
+    "libdeflate", libdeflate_backend_new_state, libdeflate_backend_inflate, libdeflate_backend_crc32, libdeflate_backend_free_state
+};
+#endif
+
+
+#ifdef HAVE_ISAL
+static void* isal_backend_new_state() {
+    return malloc(sizeof (struct inflate_state));
+}
+
+
+static bool isal_backend_inflate(void* state, unsigned char* in, size_t in_len, char* out, size_t out_size, size_t* out_len) {
+    struct inflate_state* s = state;
+    isal_inflate_init(s);
+    s->crc_flag = ISAL_DEFLATE;
+    s->next_in = in;
+    s->avail_in = in_len;
+    s->next_out = (unsigned char*) out;
+    s->avail_out = out_size;
+    int ret = isal_inflate_stateless(s);
+    *out_len = s->total_out;
+    return ret == ISAL_DECOMP_OK;
+}
+
+
+static unsigned long isal_backend_crc32(unsigned long crc, char* buf, size_t len) {
+    return crc32_gzip_refl(crc, (unsigned char*) buf, len);
+}
+
+
+static InflateBackend isal_backend = {
+    "isa-l", isal_backend_new_state, isal_backend_inflate, isal_backend_crc32, free
+};
+#endif
+
+
+InflateBackend* inflate_backends[] = {
+#ifdef HAVE_ISAL
+    &isal_backend,
+#endif
+#ifdef HAVE_LIBDEFLATE
+    &libdeflate_backend,
+#endif
+    &zlib_backend,
+    NULL
+};
+
+
+InflateBackend* inflate_backend_default() {
+    return inflate_backends[0];
+}
+
+
+InflateBackend* inflate_backend_find(char* name) {
+    int i;
+    for (i=0; inflate_backends[i] != NULL; i++) {
+        if (strcmp(inflate_backends[i]->name, name) == 0) {
+            return inflate_backends[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,27 @@
+#ifndef FastqFilterer_inflate_h
+#define FastqFilterer_inflate_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/*
+ A whole-buffer decompressor for raw deflate data, e.g. the contents of a BGZF block. zlib is always
+ available, and faster libraries are compiled in if the Makefile finds them (see HAVE_LIBDEFLATE and
+ HAVE_ISAL). Each thread inflating blocks should have its own state from new_state.
+ */
+typedef struct {
+    char* name;
+    void* (*new_state)();
+    bool (*inflate)(void* state, unsigned char* in, size_t in_len, char* out, size_t out_size, size_t* out_len);
+    unsigned long (*crc32)(unsigned long crc, char* buf, size_t len);
+    void (*free_state)(void* state);
+} InflateBackend;
+
+
+extern InflateBackend* inflate_backends[];  // null-terminated, fastest first
+
+InflateBackend* inflate_backend_default();
+InflateBackend* inflate_backend_find(char* name);
+
+#endif
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "output.h"
+
+#define max_slices 1024  // IOV_MAX on Linux
+#define bgzf_header_size 18
+#define bgzf_footer_size 8
+
+// an empty BGZF block, which marks the end of the file
+static const unsigned char bgzf_eof[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+
+static void put_le16(unsigned char* p, unsigned int x) {
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+}
+
+
+static void put_le32(unsigned char* p, unsigned long x) {
+    put_le16(p, x & 0xffff);
+    put_le16(p + 2, (x >> 16) & 0xffff);
+}
+
+
+static void compress_block(Task* task) {
+    /*
+     Deflate a block of at most bgzf_block_size bytes into a single BGZF member: a gzip header with a 'BC'
+     extra field giving the block's total size, raw deflate data, then the CRC32 and length of the input.
+     */
+    CompressJob* job = (CompressJob*) task;
+    unsigned char* out = job->out;
+
+    static const unsigned char header[bgzf_header_size - 2] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00
+    };
+    memcpy(out, header, sizeof header);
+
+    deflateReset(&job->zs);
+    job->zs.next_in = (unsigned char*) job->in;
+    job->zs.avail_in = job->in_len;
+    job->zs.next_out = out + bgzf_header_size;
+    job->zs.avail_out = bgzf_max_block_size - bgzf_header_size - bgzf_footer_size;
+    deflate(&job->zs, Z_FINISH);  // a full block of any input always fits, per deflateBound
+
+    size_t deflated_len = job->zs.total_out;
+    job->out_len = bgzf_header_size + deflated_len + bgzf_footer_size;
+    put_le16(out + 16, job->out_len - 1);
+    put_le32(out + bgzf_header_size + deflated_len, crc32(crc32(0, NULL, 0), (unsigned char*) job->in, job->in_len));
+    put_le32(out + bgzf_header_size + deflated_len + 4, job->in_len);
+}
+
+
+static void write_all(OutputFile* out, struct iovec* iov, int niov) {
+    /*
+     writev the given slices in full, picking up where it left off after any partial writes, or hand them to the
+     file's AsyncWriter, if it has one.
+     */
+    if (out->writer != NULL) {
+        int i;
+        for (i=0; i<niov; i++) {
+            writer_write(out->writer, iov[i].iov_base, iov[i].iov_len);
+        }
+        return;
+    }
+    while (niov > 0) {
+        ssize_t nbytes = writev(out->fd, iov, niov);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            out->error = true;
+            return;
+        }
+        while (niov > 0 && (size_t) nbytes >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            niov--;
+        }
+        if (niov > 0) {
+            iov->iov_base = (char*) iov->iov_base + nbytes;
+            iov->iov_len -= nbytes;
+        }
+    }
+}
+
+
+OutputFile* output_open(char* path, int compress_level, ThreadPool* pool, AsyncMode async_mode) {
+    /*
+     Open a file for output, or stdout if the path is "-". With an async_mode other than async_off, data is
+     written out through an AsyncWriter, unless the file can't be seeked in or is only appended to, e.g. a pipe,
+     in which case it is written synchronously.
+
+     :output: the new OutputFile, or NULL if the file couldn't be opened or io_uring couldn't be set up
+     */
+    int fd = strcmp(path, "-") == 0 ? dup(STDOUT_FILENO) : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    AsyncWriter* writer = NULL;
+    bool seekable = lseek(fd, 0, SEEK_CUR) >= 0 && !(fcntl(fd, F_GETFL) & O_APPEND);
+    if (async_mode != async_off && seekable && (writer = writer_open(fd, async_mode)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    OutputFile* out = malloc(sizeof (OutputFile));
+    out->fd = fd;
+    out->writer = writer;
+    out->compress_level = compress_level;
+    out->slices = malloc(sizeof (struct iovec) * max_slices);
+    out->nslices = 0;
+    out->error = false;
+    out->pool = pool;
+    out->jobs = NULL;
+    out->njobs = 0;
+    out->first = 0;
+    out->pending = 0;
+
+    if (compress_level >= 0) {
+        // enough blocks to keep every thread in the pool busy, plus one to fill in the meantime
+        out->njobs = pool == NULL ? 1 : pool->nthreads * 2 + 1;
+        out->jobs = malloc(sizeof (CompressJob) * out->njobs);
+        int i;
+        for (i=0; i<out->njobs; i++) {
+            CompressJob* job = &out->jobs[i];
+            task_init(&job->task, compress_block);
+            memset(&job->zs, 0, sizeof (z_stream));
+            deflateInit2(&job->zs, compress_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            job->in = malloc(bgzf_block_size);
+            job->in_len = 0;
+            job->out = malloc(bgzf_max_block_size);
+            job->out_len = 0;
+        }
+    }
+    return out;
+}
+
+
+static void write_oldest_block(OutputFile* out) {
+    CompressJob* job = &out->jobs[out->first];
+    task_wait(&job->task);
+    struct iovec block = {job->out, job->out_len};
+    write_all(out, &block, 1);
+    job->in_len = 0;
+    out->first = (out->first + 1) % out->njobs;
+    out->pending--;
+}
+
+
+static void submit_block(OutputFile* out) {
+    /*
+     Send the block currently being filled off for compression, and if all blocks are now busy, wait for the
+     oldest one and write it out so it can be filled next.
+     */
+    CompressJob* job = &out->jobs[(out->first + out->pending) % out->njobs];
+    out->pending++;
+    if (out->pool == NULL) {
+        compress_block(&job->task);
+        job->task.done = true;
+    } else {
+        pool_submit(out->pool, &job->task);
+    }
+
+    if (out->pending == out->njobs) {
+        write_oldest_block(out);
+    }
+}
+
+
+void output_write(OutputFile* out, char* data, size_t len) {
+    if (out->compress_level < 0) {
+        if (len == 0) {
+            return;
+        }
+        if (out->nslices > 0) {
+            struct iovec* last = &out->slices[out->nslices - 1];
+            if ((char*) last->iov_base + last->iov_len == data) {  // e.g. consecutive reads from the same batch
+                last->iov_len += len;
+                return;
+            }
+        }
+        if (out->nslices == max_slices) {
+            output_flush(out);
+        }
+        out->slices[out->nslices].iov_base = data;
+        out->slices[out->nslices].iov_len = len;
+        out->nslices++;
+        return;
+    }
+
+    while (len > 0) {
+        CompressJob* job = &out->jobs[(out->first + out->pending) % out->njobs];
+        size_t nbytes = bgzf_block_size - job->in_len;
+        if (nbytes > len) {
+            nbytes = len;
+        }
+        memcpy(job->in + job->in_len, data, nbytes);
+        job->in_len += nbytes;
+        data += nbytes;
+        len -= nbytes;
+
+        if (job->in_len == bgzf_block_size) {
+            submit_block(out);
+        }
+    }
+}
+
+
+void output_flush(OutputFile* out) {
+    /*
+     Write out all slices of uncompressed output held so far. Compressed output has already been copied into
+     its blocks, so there is nothing to do.
+     */
+    write_all(out, out->slices, out->nslices);
+    out->nslices = 0;
+}
+
+
+int output_close(OutputFile* out) {
+    /*
+     Flush and close the file, and free the OutputFile. Does nothing for a NULL file, e.g. one left unopened.
+
+     :output: 0 if everything was written successfully, otherwise -1
+     */
+    if (out == NULL) {
+        return 0;
+    }
+    output_flush(out);
+    if (out->compress_level >= 0) {
+        if (out->jobs[(out->first + out->pending) % out->njobs].in_len > 0) {
+            submit_block(out);
+        }
+        while (out->pending > 0) {
+            write_oldest_block(out);
+        }
+        struct iovec eof_block = {(void*) bgzf_eof, sizeof bgzf_eof};
+        write_all(out, &eof_block, 1);
+
+        int i;
+        for (i=0; i<out->njobs; i++) {
+            deflateEnd(&out->jobs[i].zs);
+            task_destroy(&out->jobs[i].task);
+            free(out->jobs[i].in);
+            free(out->jobs[i].out);
+        }
+        free(out->jobs);
+    }
+    if (out->writer != NULL && writer_close(out->writer) != 0) {
+        out->error = true;
+    }
+    int ret_val = (close(out->fd) != 0 || out->error) ? -1 : 0;
+    free(out->slices);
+    free(out);
+    return ret_val;
+}
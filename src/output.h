@@ -0,0 +1,54 @@
+#ifndef FastqFilterer_output_h
+#define FastqFilterer_output_h
+
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#include "pool.h"
+#include "writer.h"
+
+#define bgzf_block_size 0xff00  // maximum uncompressed bytes per BGZF block, as used by htslib
+#define bgzf_max_block_size 0x10000
+
+
+typedef struct {
+    Task task;  // must be first, so the task can be cast back to its job
+    z_stream zs;
+    char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+} CompressJob;
+
+
+/*
+ An output file, which is either written uncompressed, or compressed as BGZF: a series of gzip members of
+ at most 64KB each, which any gzip reader can decompress as one file. Blocks are compressed on a ThreadPool
+ if one is given, and always written out in the order they were filled.
+
+ Uncompressed output is not copied: each write is kept as a slice of the caller's buffer, adjacent slices
+ are merged, and they are all written out together with writev on output_flush. Data passed to
+ output_write must therefore stay valid until the next output_flush or output_close.
+
+ With an AsyncWriter, everything that would be written out is instead copied into the writer's buffers, and
+ written in the background, so neither output_flush nor filling a compressed block waits on the filesystem.
+ */
+typedef struct {
+    int fd;
+    AsyncWriter* writer;  // NULL for synchronous output
+    int compress_level;  // -1 for uncompressed output
+    struct iovec* slices;
+    int nslices;
+    ThreadPool* pool;
+    CompressJob* jobs;  // ring of blocks, with the ones being compressed followed by the one being filled
+    int njobs, first, pending;
+    bool error;
+} OutputFile;
+
+
+OutputFile* output_open(char* path, int compress_level, ThreadPool* pool, AsyncMode async_mode);
+void output_write(OutputFile* out, char* data, size_t len);
+void output_flush(OutputFile* out);
+int output_close(OutputFile* out);
+
+#endif
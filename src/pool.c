@@ -0,0 +1,213 @@
+#include <stdlib.h>
+#include "pool.h"
+
+#define initial_deque_capacity 64
+
+static __thread ThreadPool* current_pool = NULL;  // the pool this thread is a worker of, if any
+static __thread int current_worker;
+
+
+void task_init(Task* task, void (*func)(Task*)) {
+    task->func = func;
+    task->done = false;
+    pthread_mutex_init(&task->lock, NULL);
+    pthread_cond_init(&task->cond, NULL);
+}
+
+
+static void deque_init(TaskDeque* deque) {
+    deque->capacity = initial_deque_capacity;
+    deque->tasks = malloc(sizeof (Task*) * deque->capacity);
+    deque->head = 0;
+    deque->size = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+}
+
+
+static void deque_push(TaskDeque* deque, Task* task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->size == deque->capacity) {
+        // unwrap the ring into a buffer twice the size, so that submitting never blocks
+        Task** tasks = malloc(sizeof (Task*) * deque->capacity * 2);
+        int i;
+        for (i=0; i<deque->size; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+    deque->tasks[(deque->head + deque->size) % deque->capacity] = task;
+    deque->size++;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+
+static Task* deque_pop(TaskDeque* deque) {
+    /*
+     Take the oldest task, both for the deque's own worker and for thieves, since tasks such as a file's blocks
+     are usually waited on in the order they were submitted.
+     */
+    Task* task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->size > 0) {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->size--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+
+static void deque_destroy(TaskDeque* deque) {
+    free(deque->tasks);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+
+static Task* find_task(ThreadPool* pool, int worker, bool outside) {
+    /*
+     Take a task from the worker's own deque, then from outside the pool if outside is set, then from the other
+     workers' deques.
+     */
+    Task* task = deque_pop(&pool->deques[worker]);
+    if (task == NULL && outside) {
+        task = deque_pop(&pool->deques[pool->nthreads]);
+    }
+    int i;
+    for (i=1; task == NULL && i<pool->nthreads; i++) {
+        task = deque_pop(&pool->deques[(worker + i) % pool->nthreads]);
+    }
+    if (task != NULL) {
+        __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    }
+    return task;
+}
+
+
+static void run_task(Task* task) {
+    task->func(task);
+    pthread_mutex_lock(&task->lock);
+    __atomic_store_n(&task->done, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+}
+
+
+void task_wait(Task* task) {
+    /*
+     On one of a pool's workers, run the pool's other tasks until this one is done, or until there are none left
+     to run, in which case this one must already be running. Tasks from outside the pool, which may be big, e.g.
+     a whole sample, are left for idle workers rather than started here.
+     */
+    if (current_pool != NULL) {
+        Task* other;
+        while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)
+                && (other = find_task(current_pool, current_worker, false)) != NULL) {
+            run_task(other);
+        }
+    }
+    pthread_mutex_lock(&task->lock);
+    while (!task->done) {
+        pthread_cond_wait(&task->cond, &task->lock);
+    }
+    pthread_mutex_unlock(&task->lock);
+}
+
+
+void task_destroy(Task* task) {
+    pthread_mutex_destroy(&task->lock);
+    pthread_cond_destroy(&task->cond);
+}
+
+
+typedef struct {
+    ThreadPool* pool;
+    int worker;
+} WorkerArgs;
+
+
+static void* worker_thread(void* _args) {
+    WorkerArgs* args = _args;
+    ThreadPool* pool = args->pool;
+    current_pool = pool;
+    current_worker = args->worker;
+    free(args);
+
+    while (true) {
+        Task* task = find_task(pool, current_worker, true);
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 && !pool->closed) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        bool finished = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0;  // and so the pool is closed
+        pthread_mutex_unlock(&pool->lock);
+        if (finished) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+ThreadPool* pool_new(int nthreads) {
+    ThreadPool* pool = malloc(sizeof (ThreadPool));
+    pool->nthreads = nthreads;
+    pool->deques = malloc(sizeof (TaskDeque) * (nthreads + 1));
+    pool->queued = 0;
+    pool->closed = false;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pool->threads = malloc(sizeof (pthread_t) * nthreads);
+    int i;
+    for (i=0; i<=nthreads; i++) {
+        deque_init(&pool->deques[i]);
+    }
+    for (i=0; i<nthreads; i++) {
+        WorkerArgs* args = malloc(sizeof (WorkerArgs));
+        args->pool = pool;
+        args->worker = i;
+        pthread_create(&pool->threads[i], NULL, worker_thread, args);
+    }
+    return pool;
+}
+
+
+void pool_submit(ThreadPool* pool, Task* task) {
+    task->done = false;
+    deque_push(&pool->deques[current_pool == pool ? current_worker : pool->nthreads], task);
+    // counted and signalled under the lock, so that a worker can't miss it between checking and waiting
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+void pool_free(ThreadPool* pool) {
+    /*
+     Let the workers finish any remaining tasks, then stop them.
+     */
+    pthread_mutex_lock(&pool->lock);
+    pool->closed = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    int i;
+    for (i=0; i<pool->nthreads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (i=0; i<=pool->nthreads; i++) {
+        deque_destroy(&pool->deques[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
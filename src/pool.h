@@ -0,0 +1,57 @@
+#ifndef FastqFilterer_pool_h
+#define FastqFilterer_pool_h
+
+#include <stdbool.h>
+#include <pthread.h>
+
+
+/*
+ A unit of work for a ThreadPool. Tasks are usually embedded as the first member of a larger struct holding
+ the task's inputs and outputs, which func can then cast its argument back to.
+ */
+typedef struct Task {
+    void (*func)(struct Task*);
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Task;
+
+
+/*
+ Tasks waiting to run, oldest first. Each worker of a ThreadPool has one, and the pool has one more for tasks
+ submitted from outside it.
+ */
+typedef struct {
+    Task** tasks;
+    int capacity, head, size;
+    pthread_mutex_t lock;
+} TaskDeque;
+
+
+/*
+ A work-stealing pool of threads. A task submitted by one of the pool's own workers, e.g. a block of a fastq
+ being filtered as one of many samples, goes on that worker's deque, and a worker that runs out of tasks of its
+ own takes them from outside the pool, then steals them from the other workers. A worker waiting on a task
+ keeps running its own and other workers' tasks in the meantime, so tasks can wait on the tasks they submit
+ without tying up the pool.
+ */
+typedef struct {
+    pthread_t* threads;
+    int nthreads;
+    TaskDeque* deques;  // one per worker, then one for tasks from outside the pool
+    int queued;  // tasks in all deques
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // signalled when a task is queued or the pool is closed
+} ThreadPool;
+
+
+void task_init(Task* task, void (*func)(Task*));
+void task_wait(Task* task);
+void task_destroy(Task* task);
+
+ThreadPool* pool_new(int nthreads);
+void pool_submit(ThreadPool* pool, Task* task);
+void pool_free(ThreadPool* pool);
+
+#endif
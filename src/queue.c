@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include "queue.h"
+
+
+Queue* queue_new(int capacity) {
+    Queue* q = malloc(sizeof (Queue));
+    q->items = malloc(sizeof (void*) * capacity);
+    q->capacity = capacity;
+    q->head = 0;
+    q->size = 0;
+    q->closed = false;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return q;
+}
+
+
+void queue_push(Queue* q, void* item) {
+    pthread_mutex_lock(&q->lock);
+    while (q->size == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->size) % q->capacity] = item;
+    q->size++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+void* queue_pop(Queue* q) {
+    void* item = NULL;
+    pthread_mutex_lock(&q->lock);
+    while (q->size == 0 && !q->closed) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    if (q->size > 0) {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->size--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+
+void queue_close(Queue* q) {
+    /*
+     Mark the queue as finished. Consumers will drain any remaining items, then receive NULL.
+     */
+    pthread_mutex_lock(&q->lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+
+void queue_free(Queue* q) {
+    if (q == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->items);
+    free(q);
+}
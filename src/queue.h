@@ -0,0 +1,27 @@
+#ifndef FastqFilterer_queue_h
+#define FastqFilterer_queue_h
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ A bounded, blocking FIFO queue of pointers, used to link the stages of the threaded pipeline. Pushing to a
+ full queue blocks until a consumer pops, and popping from an empty queue blocks until a producer pushes or
+ closes the queue.
+ */
+typedef struct {
+    void** items;
+    int capacity, head, size;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} Queue;
+
+
+Queue* queue_new(int capacity);
+void queue_push(Queue* q, void* item);
+void* queue_pop(Queue* q);  // returns NULL once the queue is closed and empty
+void queue_close(Queue* q);
+void queue_free(Queue* q);
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "writer.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define have_uring
+#endif
+#endif
+
+#define write_pool_threads 4
+
+
+static bool write_at(int fd, char* data, size_t len, off_t offset) {
+    // pwrite all of data, picking up where it left off after any partial writes
+    while (len > 0) {
+        ssize_t nbytes = pwrite(fd, data, len, offset);
+        if (nbytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += nbytes;
+        len -= nbytes;
+        offset += nbytes;
+    }
+    return true;
+}
+
+
+#ifdef have_uring
+/*
+ A minimal io_uring, set up with the raw system calls so as not to need liburing. Only one submission is made at
+ a time, and completions are matched to their WriteBuffer through user_data.
+ */
+struct Uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+};
+
+
+static void uring_free(Uring* r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+
+static Uring* uring_new(unsigned entries) {
+    /*
+     :output: a new ring, or NULL if io_uring isn't supported or allowed here
+     */
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Uring* r = malloc(sizeof (Uring));
+    r->fd = fd;
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_ring = r->sq_ring;
+    if (r->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->sqes != MAP_FAILED) {
+            munmap(r->sqes, r->sqes_size);
+        }
+        if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) {
+            munmap(r->cq_ring, r->cq_ring_size);
+        }
+        if (r->sq_ring != MAP_FAILED) {
+            munmap(r->sq_ring, r->sq_ring_size);
+        }
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    char* sq = r->sq_ring;
+    char* cq = r->cq_ring;
+    r->sq_head = (unsigned*) (sq + params.sq_off.head);
+    r->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    r->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned*) (sq + params.sq_off.array);
+    r->cq_head = (unsigned*) (cq + params.cq_off.head);
+    r->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    r->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+    return r;
+}
+
+
+static int uring_enter(Uring* r, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, r->fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+
+static bool uring_submit(Uring* r, WriteBuffer* buffer) {
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof (struct io_uring_sqe));
+    buffer->iov.iov_base = buffer->data;
+    buffer->iov.iov_len = buffer->len;
+    sqe->opcode = IORING_OP_WRITEV;  // rather than IORING_OP_WRITE, which needs Linux 5.6
+    sqe->fd = buffer->fd;
+    sqe->addr = (unsigned long) &buffer->iov;
+    sqe->len = 1;
+    sqe->off = buffer->offset;
+    sqe->user_data = (unsigned long) buffer;
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);  // the kernel only sees entries before the tail
+    if (uring_enter(r, 1, 0, 0) == 1 || __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) != tail) {
+        return true;  // the kernel has taken the entry, and will post its completion
+    }
+    // take the entry back, so that the next submission doesn't write this buffer again after it is written out
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+    return false;
+}
+
+
+static void uring_wait(Uring* r, WriteBuffer* buffer) {
+    /*
+     Reap completions until the given buffer's write is done. Any short write is finished off synchronously.
+     */
+    while (!buffer->done) {
+        unsigned head = *r->cq_head;
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (uring_enter(r, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+                buffer->done = true;
+                buffer->ok = false;
+                return;
+            }
+            continue;
+        }
+        struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+        WriteBuffer* completed = (WriteBuffer*) (unsigned long) cqe->user_data;
+        int res = cqe->res;
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        completed->ok = res >= 0;
+        if (res >= 0 && (size_t) res < completed->len) {
+            completed->ok = write_at(completed->fd, completed->data + res, completed->len - res, completed->offset + res);
+        }
+        completed->done = true;
+    }
+}
+#else
+struct Uring {
+    int fd;
+};
+
+
+static Uring* uring_new(unsigned entries) {
+    return NULL;
+}
+
+
+static void uring_free(Uring* r) {}
+
+
+static bool uring_submit(Uring* r, WriteBuffer* buffer) {
+    return false;
+}
+
+
+static void uring_wait(Uring* r, WriteBuffer* buffer) {}
+#endif
+
+
+static ThreadPool* write_pool = NULL;  // shared by all writers on threads
+static pthread_mutex_t write_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+bool writer_uring_available() {
+    Uring* r = uring_new(writer_nbuffers);
+    if (r == NULL) {
+        return false;
+    }
+    uring_free(r);
+    return true;
+}
+
+
+static void write_buffer(Task* task) {
+    WriteBuffer* buffer = (WriteBuffer*) task;
+    buffer->ok = write_at(buffer->fd, buffer->data, buffer->len, buffer->offset);
+}
+
+
+AsyncWriter* writer_open(int fd, AsyncMode mode) {
+    /*
+     :output: a writer for fd, or NULL if io_uring was asked for but can't be set up
+     */
+    Uring* ring = NULL;
+    if (mode == async_uring && (ring = uring_new(writer_nbuffers)) == NULL) {
+        return NULL;
+    }
+    if (mode == async_threads) {
+        pthread_mutex_lock(&write_pool_lock);  // files may be opened on several threads at once
+        if (write_pool == NULL) {
+            write_pool = pool_new(write_pool_threads);
+        }
+        pthread_mutex_unlock(&write_pool_lock);
+    }
+
+    AsyncWriter* w = malloc(sizeof (AsyncWriter));
+    w->fd = fd;
+    w->mode = mode;
+    w->first = 0;
+    w->pending = 0;
+    w->offset = lseek(fd, 0, SEEK_CUR);
+    w->ring = ring;
+    w->pool = mode == async_threads ? write_pool : NULL;
+    w->error = w->offset < 0;
+    int i;
+    for (i=0; i<writer_nbuffers; i++) {
+        WriteBuffer* buffer = &w->buffers[i];
+        task_init(&buffer->task, write_buffer);
+        buffer->fd = fd;
+        if (posix_memalign((void**) &buffer->data, 4096, writer_buffer_size) != 0) {
+            buffer->data = malloc(writer_buffer_size);
+        }
+        buffer->len = 0;
+        buffer->done = true;
+        buffer->ok = true;
+    }
+    return w;
+}
+
+
+static void wait_oldest(AsyncWriter* w) {
+    WriteBuffer* buffer = &w->buffers[w->first];
+    if (w->mode == async_uring) {
+        uring_wait(w->ring, buffer);
+    } else {
+        task_wait(&buffer->task);
+    }
+    if (!buffer->ok) {
+        w->error = true;
+    }
+    buffer->len = 0;
+    w->first = (w->first + 1) % writer_nbuffers;
+    w->pending--;
+}
+
+
+static void submit_buffer(AsyncWriter* w) {
+    /*
+     Start writing out the buffer being filled, and if all buffers are now in flight, wait for the oldest one so
+     that it can be filled next.
+     */
+    WriteBuffer* buffer = &w->buffers[(w->first + w->pending) % writer_nbuffers];
+    buffer->offset = w->offset;
+    buffer->done = false;
+    w->offset += buffer->len;
+    w->pending++;
+    if (w->mode == async_uring) {
+        if (!uring_submit(w->ring, buffer)) {
+            buffer->ok = write_at(w->fd, buffer->data, buffer->len, buffer->offset);
+            buffer->done = true;
+        }
+    } else {
+        pool_submit(w->pool, &buffer->task);
+    }
+
+    if (w->pending == writer_nbuffers) {
+        wait_oldest(w);
+    }
+}
+
+
+void writer_write(AsyncWriter* w, char* data, size_t len) {
+    while (len > 0) {
+        WriteBuffer* buffer = &w->buffers[(w->first + w->pending) % writer_nbuffers];
+        size_t nbytes = writer_buffer_size - buffer->len;
+        if (nbytes > len) {
+            nbytes = len;
+        }
+        memcpy(buffer->data + buffer->len, data, nbytes);
+        buffer->len += nbytes;
+        data += nbytes;
+        len -= nbytes;
+
+        if (buffer->len == writer_buffer_size) {
+            submit_buffer(w);
+        }
+    }
+}
+
+
+int writer_close(AsyncWriter* w) {
+    /*
+     Write out anything left, wait for all writes to finish, and free the writer. The file is left open.
+
+     :output: 0 if everything was written successfully, otherwise -1
+     */
+    if (w->buffers[(w->first + w->pending) % writer_nbuffers].len > 0) {
+        submit_buffer(w);
+    }
+    while (w->pending > 0) {
+        wait_oldest(w);
+    }
+    int ret_val = w->error ? -1 : 0;
+    if (w->ring != NULL) {
+        uring_free(w->ring);
+    }
+    int i;
+    for (i=0; i<writer_nbuffers; i++) {
+        task_destroy(&w->buffers[i].task);
+        free(w->buffers[i].data);
+    }
+    free(w);
+    return ret_val;
+}
+
+
+void writer_shutdown() {
+    // stop the threads shared by writers, once all writers are closed
+    if (write_pool != NULL) {
+        pool_free(write_pool);
+        write_pool = NULL;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef FastqFilterer_writer_h
+#define FastqFilterer_writer_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "pool.h"
+
+#define writer_buffer_size (1024 * 1024)
+#define writer_nbuffers 4  // buffers per file, i.e. the most writes in flight at once
+
+
+typedef enum {
+    async_off,  // write synchronously
+    async_uring,  // through io_uring
+    async_threads  // on a ThreadPool
+} AsyncMode;
+
+
+typedef struct {
+    Task task;  // must be first, so the task can be cast back to its buffer
+    int fd;
+    char* data;
+    size_t len;
+    off_t offset;
+    struct iovec iov;  // for io_uring
+    bool done, ok;
+} WriteBuffer;
+
+
+typedef struct Uring Uring;
+
+
+/*
+ Asynchronous writes to a file, so that a slow filesystem never stalls whatever is producing the data. Data is
+ copied into one of a ring of large, page-aligned buffers, and when a buffer fills up it is written out at its
+ offset in the file, through io_uring or on a ThreadPool, while the next one is filled. Several buffers can be
+ in flight at once, and a writer only waits for the oldest one when all of them are. The file must be
+ seekable, since writes may complete in any order.
+ */
+typedef struct {
+    int fd;
+    AsyncMode mode;
+    WriteBuffer buffers[writer_nbuffers];  // ring of buffers being written, followed by the one being filled
+    int first, pending;
+    off_t offset;  // where the buffer being filled starts in the file
+    Uring* ring;
+    ThreadPool* pool;
+    bool error;
+} AsyncWriter;
+
+
+bool writer_uring_available();
+AsyncWriter* writer_open(int fd, AsyncMode mode);
+void writer_write(AsyncWriter* w, char* data, size_t len);
+int writer_close(AsyncWriter* w);
+void writer_shutdown();
+
+#endif
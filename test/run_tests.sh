@@ -22,6 +22,14 @@ function compare {
     rm $1
 }
 
+function check_fails {
+    # check that the last command failed, e.g. because of an invalid argument
+    if [ $1 -eq 0 ]; then
+        echo "$2 did not fail"
+        exit_status=$[$exit_status+1]
+    fi
+}
+
 function check_outputs {
     compare $r1o expected_outputs/${1}R1_filtered.fastq
     compare $r2o expected_outputs/${1}R2_filtered.fastq
@@ -56,6 +64,17 @@ echo "Testing output stats"
 $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --stats_file inputs/fastq_filterer.stats
 compare inputs/fastq_filterer.stats expected_outputs/fastq_filterer.stats
 check_outputs
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --stats_file - > stdout.stats
+compare stdout.stats expected_outputs/fastq_filterer.stats
+check_outputs
+if [ -e ./- ]; then
+    echo "--stats_file - wrote a file named '-'"
+    exit_status=$[$exit_status+1]
+    rm ./-
+fi
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --stats_file inputs/nonexistent_dir/fastq_filterer.stats 2> /dev/null
+check_fails $? "--stats_file in a directory that doesn't exist"
+rm $r1o $r2o $r1f $r2f
 
 
 echo "Testing tile removal"
@@ -64,20 +83,107 @@ compare inputs/fastq_filterer.stats expected_outputs/rm_tiles.stats
 check_outputs rm_tiles_
 
 
+echo "Testing tile removal lookup"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_tiles 0,01101,1102,tile,2202,99999
+check_outputs rm_tiles_  # only exact matches on the tile ID should be removed
+long_header=inputs/long_header_R1.fastq
+(printf "%s" "$(head -1 inputs/R1.fastq) "; head -c 70000 /dev/zero | tr '\0' 'x'; echo; tail -n +2 inputs/R1.fastq) > $long_header
+$filterer --i1 $long_header --i2 inputs/R2.fastq.gz --remove_tiles 1102,2202 2> /dev/null
+check_fails $? "--remove_tiles with a header over 64KB"
+$filterer --i1 $long_header --i2 inputs/R2.fastq.gz --threads 4 --remove_tiles 1102,2202 2> /dev/null
+check_fails $? "--remove_tiles --threads with a header over 64KB"
+rm $long_header $r1o $r2o $r1f $r2f
+
+
 echo "Testing read removal"
 $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --stats_file inputs/fastq_filterer.stats
 compare inputs/fastq_filterer.stats expected_outputs/rm_reads.stats
 check_outputs rm_reads_
 
 
+echo "Testing read removal with a Bloom filter"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --bloom_filter --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/rm_reads_bloom.stats
+check_outputs rm_reads_
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --bloom_filter=0.001
+check_outputs rm_reads_
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --bloom_filter 0.5 2> /dev/null
+check_fails $? "--bloom_filter with a rate after a space"
+for fpr in 0 -0.1 1 0.5x; do
+    $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --bloom_filter=$fpr 2> /dev/null
+    check_fails $? "--bloom_filter=$fpr"
+done
+# the Bloom filter only sees read pairs not already removed by the criteria before it
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_tiles 1102,2202 --remove_reads inputs/rm_reads.txt --bloom_filter --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/rm_tiles_reads_bloom.stats
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.txt --remove_tiles 1102,2202 --bloom_filter --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/rm_reads_tiles_bloom.stats
+
+
+echo "Testing sorted read removal"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads_sorted inputs/rm_reads.txt --threads 2
+check_outputs rm_reads_
+for threads in 1 2; do
+    $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads_sorted inputs/rm_reads_unsorted.txt --threads $threads 2> /dev/null
+    check_fails $? "Out-of-order --remove_reads_sorted with $threads threads"
+    if ls R?_filtered*.fastq 2> /dev/null; then
+        echo "Out-of-order --remove_reads_sorted left its outputs behind"
+        exit_status=$[$exit_status+1]
+        rm R?_filtered*.fastq
+    fi
+done
+
+
 echo "Testing empty read removal"
 touch inputs/rm_reads_empty.txt
 $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_empty.txt
 check_outputs  # no reads to remove, so output should be just like the 'compressed' test
+../fastq_filterer index_reads inputs/rm_reads_empty.txt inputs/rm_reads_empty.idx 2> /dev/null
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_empty.idx
+check_outputs  # an empty list is still the way to remove nothing, now that a missing one is an error
+rm inputs/rm_reads_empty.idx
 
 echo "Testing nonexistent read removal"
-$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_nonexistent.txt
-check_outputs
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_nonexistent.txt 2> /dev/null
+check_fails $? "--remove_reads with a list that doesn't exist"
+../fastq_filterer index_reads inputs/rm_reads_nonexistent.txt inputs/rm_reads.idx 2> /dev/null
+check_fails $? "index_reads with a list that doesn't exist"
+
+
+echo "Testing packed read removal"
+$filterer --i1 inputs/R1_illumina.fastq --i2 inputs/R2_illumina.fastq --remove_reads inputs/rm_reads_illumina.txt --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/rm_packed.stats
+check_outputs rm_packed_  # Illumina IDs are packed, but must still only match exactly
+
+
+echo "Testing read removal index"
+../fastq_filterer index_reads inputs/rm_reads.txt inputs/rm_reads.idx
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads.idx
+check_outputs rm_reads_
+../fastq_filterer index_reads inputs/rm_reads_illumina.txt inputs/rm_reads.idx
+$filterer --i1 inputs/R1_illumina.fastq --i2 inputs/R2_illumina.fastq --remove_reads inputs/rm_reads.idx
+check_outputs rm_packed_
+head -c 100 inputs/rm_reads.idx > inputs/rm_reads_truncated.idx
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_truncated.idx 2> /dev/null
+check_fails $? "--remove_reads with a truncated index"
+../fastq_filterer index_reads inputs/rm_reads.txt inputs/rm_reads.idx 2> /dev/null
+cp inputs/rm_reads.idx inputs/rm_reads_corrupt.idx
+# fill the 1024 slots after the 56-byte header, so that they point outside the index and none are empty
+head -c 8192 /dev/zero | tr '\0' '\377' | dd of=inputs/rm_reads_corrupt.idx bs=1 seek=56 conv=notrunc 2> /dev/null
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_corrupt.idx 2> /dev/null
+check_fails $? "--remove_reads with an index of corrupt slots"
+cp inputs/rm_reads.idx inputs/rm_reads_corrupt.idx
+# 2^61 slots and 2048 packed slots add up to the file's size once multiplied out in 64 bits
+printf '\x00\x00\x00\x00\x00\x00\x00\x20' | dd of=inputs/rm_reads_corrupt.idx bs=1 seek=8 conv=notrunc 2> /dev/null
+printf '\x00\x08\x00\x00\x00\x00\x00\x00' | dd of=inputs/rm_reads_corrupt.idx bs=1 seek=40 conv=notrunc 2> /dev/null
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_reads inputs/rm_reads_corrupt.idx 2> /dev/null
+check_fails $? "--remove_reads with an index whose sizes overflow"
+rm inputs/rm_reads.idx inputs/rm_reads_truncated.idx inputs/rm_reads_corrupt.idx
+
+
+echo "Testing Y-flagged read removal"
+$filterer --i1 inputs/R1_illumina.fastq --i2 inputs/R2_illumina.fastq --remove_y_flagged
+check_outputs y_flagged_  # a read pair is removed if either read is flagged
 
 
 echo "Testing read trimming"
@@ -85,5 +191,137 @@ $filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --trim_r1 14 --trim_r2
 compare inputs/fastq_filterer.stats expected_outputs/trim_reads.stats
 check_outputs trim_reads_
 
+
+echo "Testing threaded pipeline"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --threads 4 --remove_tiles 1102,2202 --stats_file inputs/fastq_filterer.stats
+grep -v batch_memory_peak inputs/fastq_filterer.stats > inputs/threaded.stats  # depends on how threads interleave
+rm inputs/fastq_filterer.stats
+compare inputs/threaded.stats expected_outputs/threaded.stats
+check_outputs rm_tiles_
+
+echo "Testing compressed output"
+../fastq_filterer --quiet --threshold 9 --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --threads 2 --compress_output
+for f in inputs/R?_filtered*.fastq.gz; do
+    gzip -dc $f > $(basename $f .gz)
+    rm $f
+done
+check_outputs
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --compress_output=1
+for f in $r1o $r2o $r1f $r2f; do
+    gzip -dc $f > $f.tmp  # written to the given names, compressed
+    mv $f.tmp $f
+done
+check_outputs
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --compress_output 1 2> /dev/null
+check_fails $? "--compress_output with a level after a space"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --compress_output=-5 2> /dev/null
+check_fails $? "--compress_output=-5"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --compress_output=10 2> /dev/null
+check_fails $? "--compress_output=10"
+
+echo "Testing asynchronous output"
+for i in $(seq 4000); do echo inputs/R1.fastq; done | xargs cat > R1_large.fastq  # enough to fill several buffers
+for i in $(seq 4000); do echo inputs/R2.fastq; done | xargs cat > R2_large.fastq
+$filterer --i1 R1_large.fastq --i2 R2_large.fastq
+for f in $r1o $r2o $r1f $r2f; do mv $f sync_$f; done
+for backend in io_uring threads; do
+    $filterer --i1 R1_large.fastq --i2 R2_large.fastq --async_output=$backend
+    for f in $r1o $r2o $r1f $r2f; do compare $f sync_$f; done
+done
+rm R?_large.fastq sync_*
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --async_output --threads 2
+check_outputs
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --async_output threads 2> /dev/null
+check_fails $? "--async_output with a backend after a space"
+
+echo "Testing BGZF input"
+$filterer --i1 inputs/R1_bgzf.fastq.gz --i2 inputs/R2_bgzf.fastq.gz
+check_outputs
+
+echo "Testing parallel BGZF input"
+$filterer --i1 inputs/R1_bgzf.fastq.gz --i2 inputs/R2_bgzf.fastq.gz --threads 2
+check_outputs
+
+echo "Testing criteria stats"
+$filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --remove_tiles 1102,2202 --criteria_stats --adaptive_criteria --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/criteria_stats.stats
+check_outputs rm_tiles_
+
+
+echo "Testing interleaved input"
+$filterer --i1 inputs/interleaved.fastq --interleaved_in
+check_outputs
+$filterer --i1 inputs/interleaved.fastq --interleaved_in --threads 4 --remove_tiles 1102,2202
+check_outputs rm_tiles_
+
+echo "Testing interleaved output"
+interleaved_filterer="../fastq_filterer --quiet --o1 $r1o --f1 $r1f --threshold 9 --interleaved_out"
+$interleaved_filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz
+compare $r1o expected_outputs/interleaved_filtered.fastq
+compare $r1f expected_outputs/interleaved_filtered_reads.fastq
+$interleaved_filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz --trim_r1 14 --trim_r2 16 --threads 4
+compare $r1o expected_outputs/trim_reads_interleaved_filtered.fastq
+compare $r1f expected_outputs/interleaved_filtered_reads.fastq
+$interleaved_filterer --i1 inputs/interleaved.fastq --interleaved_in
+compare $r1o expected_outputs/interleaved_filtered.fastq
+compare $r1f expected_outputs/interleaved_filtered_reads.fastq
+for r2_option in "--o2 $r2o" "--f2 $r2f"; do
+    $interleaved_filterer --i1 inputs/R1.fastq.gz --i2 inputs/R2.fastq.gz $r2_option 2> /dev/null
+    check_fails $? "--interleaved_out with $r2_option"
+done
+$filterer --i1 inputs/interleaved.fastq --i2 inputs/R2.fastq.gz --interleaved_in 2> /dev/null
+check_fails $? "--interleaved_in with --i2"
+echo "______________________"
+
+echo "Testing streamed input and output"
+cat inputs/R1.fastq.gz | $filterer --i1 - --i2 <(cat inputs/R2_bgzf.fastq.gz) --o1 - --async_output > stdout.fastq
+mv stdout.fastq $r1o
+check_outputs
+mkfifo R1_fifo.fastq
+cat inputs/R1.fastq > R1_fifo.fastq &
+$filterer --i1 R1_fifo.fastq --i2 inputs/R2.fastq --threads 2
+wait
+rm R1_fifo.fastq
+check_outputs
+
+echo "Testing single-end mode"
+single_end_filterer="../fastq_filterer --quiet --o1 $r1o --f1 $r1f --threshold 9 --single_end"
+$single_end_filterer --i1 inputs/R1.fastq.gz --stats_file inputs/fastq_filterer.stats
+compare inputs/fastq_filterer.stats expected_outputs/single_end.stats
+compare $r1o expected_outputs/single_end_R1_filtered.fastq
+compare $r1f expected_outputs/single_end_R1_filtered_reads.fastq
+$single_end_filterer --i1 inputs/R1.fastq --threads 4
+compare $r1o expected_outputs/single_end_R1_filtered.fastq
+compare $r1f expected_outputs/single_end_R1_filtered_reads.fastq
+for r2_option in "--i2 inputs/R2.fastq" "--o2 $r2o" "--f2 $r2f" "--trim_r2 5"; do
+    $single_end_filterer --i1 inputs/R1.fastq $r2_option 2> /dev/null
+    check_fails $? "--single_end with $r2_option"
+done
+echo "______________________"
+
+echo "Testing batch mode"
+manifest=inputs/manifest.tsv
+printf "# i1\ti2\to1\to2\tf1\tf2\tstats_file\n" > $manifest
+printf "inputs/R1.fastq.gz\tinputs/R2.fastq.gz\t$r1o\t$r2o\t$r1f\t$r2f\tinputs/fastq_filterer.stats\n" >> $manifest
+printf "inputs/R1_bgzf.fastq.gz\tinputs/R2_bgzf.fastq.gz\tS2_$r1o\tS2_$r2o\tS2_$r1f\tS2_$r2f\n" >> $manifest
+function check_batch_outputs {
+    compare S2_$r1o expected_outputs/R1_filtered.fastq
+    compare S2_$r2o expected_outputs/R2_filtered.fastq
+    compare S2_$r1f expected_outputs/R1_filtered_reads.fastq
+    compare S2_$r2f expected_outputs/R2_filtered_reads.fastq
+    check_outputs
+}
+../fastq_filterer --quiet --threshold 9 --manifest $manifest
+compare inputs/fastq_filterer.stats expected_outputs/manifest.stats
+check_batch_outputs
+../fastq_filterer --quiet --threshold 9 --threads 4 --manifest $manifest
+compare inputs/fastq_filterer.stats expected_outputs/manifest.stats  # no batch_memory_peak, so no timing in it
+check_batch_outputs
+for threads in 0 -1 x; do
+    ../fastq_filterer --quiet --threshold 9 --threads $threads --manifest $manifest 2> /dev/null
+    check_fails $? "--manifest with --threads $threads"
+done
+rm $manifest
+
 echo "Finished tests with exit status $exit_status"
 exit $exit_status